@@ -39,6 +39,20 @@
 #define RFP_BASE 195
 #define RFP_FACTOR 124
 #define CASTLE_BONUS 30
+#define SPLIT_MIN_DEPTH 4
+#define COUNTER_MOVE_BONUS 40
+#define HISTORY_DIVISOR 512
+#define CAPTURE_HISTORY_DIVISOR 1024
+#define LOSING_CAPTURE_MALUS 1000
+#define LMR_BASE 512
+#define LMR_DIVISOR 300
+#define LMR_HISTORY_DIVISOR 16384
+#define LMR_PV 1024
+#define LMR_NOT_IMPROVING 512
+#define LMP_DEPTH 6
+#define LMP_BASE 3
+#define HP_DEPTH 3
+#define HP_MARGIN 512
 
 // Piece square values
 const int PS_BLACK_PAWN[] = {0, 0, 0, 0, 0, 0, 0, 0, -50, -52, -50, -50, -50, -50, -50, -48, -9, -10, -20, -33, -30, -20, -11, -10, -4, -2, -10, -24, -26, -10, -6, -6, 0, 0, 0, -20, -20, 0, 0, 0, -4, 4, 9, 0, 0, 11, 5, -6, -5, -10, -10, 20, 20, -10, -10, -4, 0, 0, 0, 0, 0, 0, 0, 0};
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // sched_getaffinity and pthread_setaffinity_np
+#endif
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -18,54 +21,232 @@
 #define class typedef struct
 #define INF 1000000000
 
-// Uncomment to enable beta cutoff tracking (has performance cost)
-// #define TRACK_BETA_CUTOFFS
-
-#ifdef TRACK_BETA_CUTOFFS
-static atomic_size_t total_nodes = 0;
-static atomic_size_t beta_cutoffs = 0;
-static atomic_size_t first_move_cutoffs = 0;
-static atomic_size_t total_cutoff_index = 0;
-#endif
-
-// Uncomment to enable TT tracking (has performance cost)
-// #define TRACK_TT
-
-#ifdef TRACK_TT
-static atomic_size_t tt_lookups = 0;
-static atomic_size_t tt_hits = 0;
-static atomic_size_t tt_collisions = 0;
-static atomic_size_t tt_stores = 0;
-#endif
-
-// Uncomment to enable node tracking (has performance cost)
-// #define TRACK_NODES
-
-#ifdef TRACK_NODES
-static atomic_size_t nodes_searched = 0;
-#endif
-
 #define ISLOWER(c) ((c) >= 'a' && (c) <= 'z')
 #define ISUPPER(c) ((c) >= 'A' && (c) <= 'Z')
 #define likely(cond) (!__builtin_expect(!(cond), 0))
 #define unlikely(cond) (__builtin_expect((cond), 0))
 
+// Search statistics of one thread, aligned so that no two threads share a cache line
+// Nodes, qnodes and the pruned late moves are always counted, the rest needs --stats
+class {
+    uint64_t nodes;   // All nodes, quiescence included
+    uint64_t qnodes;  // Quiescence nodes
+    uint64_t tt_probes;
+    uint64_t tt_hits;
+    uint64_t tt_stores;
+    uint64_t tt_collisions;
+    uint64_t move_nodes;  // Nodes that reached the move loop
+    uint64_t beta_cutoffs;
+    uint64_t first_move_cutoffs;
+    uint64_t cutoff_index_sum;
+    uint64_t null_move_cutoffs;
+    uint64_t futility_prunes;
+    uint64_t reverse_futility_prunes;
+    uint64_t lmr_researches;
+    uint64_t late_move_prunes;  // Quiet moves skipped past the move count of their depth
+    uint64_t history_prunes;    // Quiet moves skipped for their bad history
+    uint64_t split_points;  // Opened with --split
+    uint64_t split_joins;   // Times a worker helped at a split point
+} __attribute__((aligned(64)))
+SearchStats;
+
+// Slot 0 is used by the main thread, worker i uses slot i + 1
+#define MAX_THREADS 256
+SearchStats search_stats[MAX_THREADS + 1];
+static _Thread_local SearchStats* stats = &search_stats[0];
+bool stats_enabled = false;
+
+#define STATS_ADD(field, n)                              \
+    do {                                                 \
+        if unlikely (stats_enabled) stats->field += (n); \
+    } while (0)
+
+void SearchStats_add(SearchStats* total, SearchStats* s) {
+    uint64_t* src = (uint64_t*)s;
+    uint64_t* dst = (uint64_t*)total;
+    for (int j = 0; j < sizeof(SearchStats) / sizeof(uint64_t); j++) dst[j] += src[j];
+}
+
+// Sum the statistics of the slots [first, last), only called at report time
+SearchStats SearchStats_total(int first, int last) {
+    SearchStats total = {0};
+    for (int i = first; i < last; i++) SearchStats_add(&total, &search_stats[i]);
+    return total;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole > 0 ? (double)part * 100.0 / whole : 0.0;
+}
+
+double TT_occupancy(void);
+
+// Print the statistics as a JSON object member followed by a comma
+void SearchStats_print(SearchStats* s, const char* indent) {
+    printf("%s\"stats\": {\n", indent);
+    printf("%s  \"qnodes\": %" PRIu64 ",\n", indent, s->qnodes);
+    printf("%s  \"tt_probes\": %" PRIu64 ",\n", indent, s->tt_probes);
+    printf("%s  \"tt_hit_%%\": %.2f,\n", indent, percent(s->tt_hits, s->tt_probes));
+    printf("%s  \"tt_stores\": %" PRIu64 ",\n", indent, s->tt_stores);
+    printf("%s  \"tt_collision_%%\": %.2f,\n", indent, percent(s->tt_collisions, s->tt_stores));
+    printf("%s  \"tt_occupancy_%%\": %.2f,\n", indent, TT_occupancy() * 100.0);
+    printf("%s  \"move_nodes\": %" PRIu64 ",\n", indent, s->move_nodes);
+    printf("%s  \"beta_cutoff_%%\": %.2f,\n", indent, percent(s->beta_cutoffs, s->move_nodes));
+    printf("%s  \"first_move_cutoff_%%\": %.2f,\n", indent,
+           percent(s->first_move_cutoffs, s->beta_cutoffs));
+    printf("%s  \"avg_cutoff_index\": %.2f,\n", indent,
+           s->beta_cutoffs > 0 ? (double)s->cutoff_index_sum / s->beta_cutoffs : 0.0);
+    printf("%s  \"null_move_cutoffs\": %" PRIu64 ",\n", indent, s->null_move_cutoffs);
+    printf("%s  \"futility_prunes\": %" PRIu64 ",\n", indent, s->futility_prunes);
+    printf("%s  \"reverse_futility_prunes\": %" PRIu64 ",\n", indent, s->reverse_futility_prunes);
+    printf("%s  \"lmr_researches\": %" PRIu64 ",\n", indent, s->lmr_researches);
+    printf("%s  \"late_move_prunes\": %" PRIu64 ",\n", indent, s->late_move_prunes);
+    printf("%s  \"history_prunes\": %" PRIu64 ",\n", indent, s->history_prunes);
+    printf("%s  \"split_points\": %" PRIu64 ",\n", indent, s->split_points);
+    printf("%s  \"split_joins\": %" PRIu64 "\n", indent, s->split_joins);
+    printf("%s},\n", indent);
+}
+
+// Search tree profile, recorded per remaining depth and per ply with --profile
+#define PROFILE_MAX_PLY 64
+#define PROFILE_CUTOFF_INDICES 16  // The last bucket also counts the later move indices
+
+class {
+    uint64_t nodes;
+    uint64_t move_nodes;  // Nodes that reached the move loop
+    uint64_t cutoff_index[PROFILE_CUTOFF_INDICES];
+    uint64_t tt_cutoffs;
+    uint64_t futility_prunes;
+    uint64_t reverse_futility_prunes;
+    uint64_t null_move_cutoffs;
+    uint64_t lmr_researches;
+}
+DepthProfile;
+
+class {
+    uint64_t ply_nodes[PROFILE_MAX_PLY];
+    DepthProfile depths[PROFILE_MAX_PLY];
+}
+SearchProfile;
+
+// NULL unless --profile, slots are used like search_stats
+SearchProfile* search_profiles = NULL;
+static _Thread_local SearchProfile* profile = NULL;
+// Size of the zobrist hash stack at ply 0 of the current search
+static _Thread_local int profile_root_sp = 0;
+
+#define PROFILE_INDEX(x) ((x) < 0 ? 0 : (x) < PROFILE_MAX_PLY ? (x) : PROFILE_MAX_PLY - 1)
+#define PROFILE_ADD(depth, field)                                                    \
+    do {                                                                             \
+        if unlikely (profile != NULL) profile->depths[PROFILE_INDEX(depth)].field++; \
+    } while (0)
+
+static inline void profile_node(int depth, int sp) {
+    if likely (profile == NULL) return;
+    profile->ply_nodes[PROFILE_INDEX(sp - profile_root_sp)]++;
+    profile->depths[PROFILE_INDEX(depth)].nodes++;
+}
+
+static inline void profile_cutoff(int depth, int move_index) {
+    if likely (profile == NULL) return;
+    int i = move_index < PROFILE_CUTOFF_INDICES ? move_index : PROFILE_CUTOFF_INDICES - 1;
+    profile->depths[PROFILE_INDEX(depth)].cutoff_index[i]++;
+}
+
+void SearchProfile_add(SearchProfile* total, SearchProfile* p) {
+    uint64_t* src = (uint64_t*)p;
+    uint64_t* dst = (uint64_t*)total;
+    for (int j = 0; j < sizeof(SearchProfile) / sizeof(uint64_t); j++) dst[j] += src[j];
+}
+
+// Print the profile as a JSON object member followed by a comma, skipping unreached depths
+void SearchProfile_print(SearchProfile* p, const char* indent) {
+    int max_ply = 0;
+    for (int i = 0; i < PROFILE_MAX_PLY; i++) {
+        if (p->ply_nodes[i]) max_ply = i + 1;
+    }
+
+    printf("%s\"profile\": {\n", indent);
+    printf("%s  \"ply_nodes\": [", indent);
+    for (int i = 0; i < max_ply; i++) {
+        printf("%s%" PRIu64, i ? ", " : "", p->ply_nodes[i]);
+    }
+    printf("],\n");
+    printf("%s  \"depths\": [", indent);
+    bool first = true;
+    for (int d = 0; d < PROFILE_MAX_PLY; d++) {
+        DepthProfile* dp = &p->depths[d];
+        if (!dp->nodes) continue;
+        printf("%s\n%s    {\"depth\": %d, \"nodes\": %" PRIu64 ", \"move_nodes\": %" PRIu64,
+               first ? "" : ",", indent, d, dp->nodes, dp->move_nodes);
+        printf(", \"cutoff_index\": [");
+        for (int i = 0; i < PROFILE_CUTOFF_INDICES; i++) {
+            printf("%s%" PRIu64, i ? ", " : "", dp->cutoff_index[i]);
+        }
+        printf("], \"tt_cutoffs\": %" PRIu64 ", \"futility_prunes\": %" PRIu64
+               ", \"reverse_futility_prunes\": %" PRIu64 ", \"null_move_cutoffs\": %" PRIu64
+               ", \"lmr_researches\": %" PRIu64 "}",
+               dp->tt_cutoffs, dp->futility_prunes, dp->reverse_futility_prunes,
+               dp->null_move_cutoffs, dp->lmr_researches);
+        first = false;
+    }
+    printf("\n%s  ]\n", indent);
+    printf("%s},\n", indent);
+}
+
 #ifdef _WIN32
 #define TIME_TYPE clock_t
 #define TIME_NOW() clock()
 #define TIME_DIFF_S(end, start) ((double)((end) - (start)) / CLOCKS_PER_SEC)
 #define TIME_PLUS_OFFSET_MS(start, millis) ((start) + CLOCKS_PER_SEC * (millis) / 1000)
 #include <windows.h>
-int cpu_count(void) {
+static int cpu_count_uncached(void) {
     SYSTEM_INFO sysinfo;
     GetSystemInfo(&sysinfo);
     return sysinfo.dwNumberOfProcessors;
 }
 
 #else
+#include <sched.h>
 #include <unistd.h>
-int cpu_count(void) {
+#ifdef __linux__
+
+// CPUs allowed by the cgroup quota, rounded up, or 0 if there is no quota
+// Reads cgroup v2 cpu.max and falls back to the v1 cfs files
+static int cgroup_cpu_limit(void) {
+    long long quota = -1, period = 0;
+    FILE* f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f) {
+        char max[32];
+        if (fscanf(f, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0) {
+            quota = atoll(max);
+        }
+        fclose(f);
+    } else {
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &quota) != 1) quota = -1;
+            fclose(f);
+        }
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &period) != 1) period = 0;
+            fclose(f);
+        }
+    }
+    if (quota <= 0 || period <= 0) return 0;
+    return (int)((quota + period - 1) / period);
+}
+#endif
+
+static int cpu_count_uncached(void) {
     long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    // Only the CPUs of our cpuset (taskset, docker --cpuset-cpus)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) nprocs = CPU_COUNT(&set);
+    int limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < nprocs) nprocs = limit;
+#endif
     return (nprocs > 0) ? nprocs : 1;
 }
 __attribute__((always_inline)) static inline uint64_t now_nanos() {
@@ -83,6 +264,150 @@ __attribute__((always_inline)) static inline uint64_t now_nanos() {
 #define TIME_PLUS_OFFSET_MS(start, millis) ((start) + ((uint64_t)millis) * 1000000)
 #endif
 
+// Usable CPUs, computed once since it costs syscalls and file reads
+int cpu_count(void) {
+    static int count = 0;
+    if (!count) count = cpu_count_uncached();
+    return count;
+}
+
+// Worker threads of play and perft, 0 for cpu_count(), set with --threads
+int search_threads = 0;
+
+int default_threads(void) { return search_threads > 0 ? search_threads : cpu_count(); }
+
+// Best root moves reported by play and go, set with --multipv
+#define MAX_MULTIPV 32
+int multipv_lines = 1;
+
+// CPUs the workers are pinned to with --affinity, worker i gets affinity_cpus[i % n]
+#define MAX_AFFINITY_CPUS 1024
+int affinity_cpus[MAX_AFFINITY_CPUS];
+int n_affinity_cpus = 0;
+
+// Parse a cpu list like "0-3,8,10-11", returns false if it is malformed or has a cpu
+// this process can't run on (offline, or outside its cpuset)
+bool affinity_parse(const char* list) {
+    n_affinity_cpus = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+#endif
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return false;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return false;
+        }
+        for (long cpu = first; cpu <= last && n_affinity_cpus < MAX_AFFINITY_CPUS; cpu++) {
+#ifdef __linux__
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) return false;
+#endif
+            affinity_cpus[n_affinity_cpus++] = (int)cpu;
+        }
+        if (*end == ',') end++;
+        else if (*end != 0) return false;
+        p = end;
+    }
+    return n_affinity_cpus > 0;
+}
+
+// Pin the calling worker thread if --affinity was given
+void affinity_pin(int worker) {
+    if (n_affinity_cpus == 0) return;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int cpu = affinity_cpus[worker % n_affinity_cpus];
+    CPU_SET(cpu, &set);
+    // affinity_parse checked the cpus, they may have gone offline since
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        fprintf(stderr, "Could not pin worker %d to cpu %d: %s\n", worker, cpu, strerror(error));
+    }
+#endif
+}
+
+// Process-wide pool of worker threads, started on first use and parked between jobs
+// so that search, perft and bench don't create and join threads for every call
+typedef void (*pool_fn)(void* arg, int worker);
+
+struct {
+    pthread_t threads[MAX_THREADS];
+    int n_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;  // Signaled when a new job is posted
+    pthread_cond_t done;   // Signaled when the last worker of a job finished
+    pool_fn fn;
+    void* arg;
+    int n_workers;        // Workers [0, n_workers) take part in the current job
+    int running;          // Workers still inside fn
+    uint64_t generation;  // Incremented for every job
+} pool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+          .start = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+static void* pool_worker(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    affinity_pin(worker);
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    while (1) {
+        while (pool.generation == seen) pthread_cond_wait(&pool.start, &pool.mutex);
+        seen = pool.generation;
+        if (worker >= pool.n_workers) continue;
+
+        pool_fn fn = pool.fn;
+        void* fn_arg = pool.arg;
+        pthread_mutex_unlock(&pool.mutex);
+        fn(fn_arg, worker);
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.running == 0) pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+// Start fn(arg, worker) on workers 0..n_workers-1, pool_wait waits for all of them
+// Only called from the main thread, one job at a time
+void pool_start(int n_workers, pool_fn fn, void* arg) {
+    if (n_workers > MAX_THREADS) n_workers = MAX_THREADS;
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.n_started < n_workers) {
+        intptr_t worker = pool.n_started;
+        if (pthread_create(&pool.threads[worker], NULL, pool_worker, (void*)worker) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        pool.n_started++;
+    }
+
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.n_workers = n_workers;
+    pool.running = n_workers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void pool_wait(void) {
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+// Run fn(arg, worker) on workers 0..n_workers-1 and wait for all of them to return
+void pool_run(int n_workers, pool_fn fn, void* arg) {
+    pool_start(n_workers, fn, arg);
+    pool_wait();
+}
+
 // A bitboard is a 64-bit integer where each bit represents a square on the
 // chessboard (from a1 to h8). The least significant bit (LSB) represents a1,
 // and the most significant bit (MSB) represents h8.
@@ -222,6 +547,18 @@ static inline int Piece_value(Piece piece) {
     }
 }
 
+// Piece types without the color, the index of a piece in the history tables
+typedef enum { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING } PieceType;
+
+static const uint8_t PIECE_TYPES[128] = {
+    [WHITE_PAWN] = PAWN,     [BLACK_PAWN] = PAWN,     [WHITE_KNIGHT] = KNIGHT,
+    [BLACK_KNIGHT] = KNIGHT, [WHITE_BISHOP] = BISHOP, [BLACK_BISHOP] = BISHOP,
+    [WHITE_ROOK] = ROOK,     [BLACK_ROOK] = ROOK,     [WHITE_QUEEN] = QUEEN,
+    [BLACK_QUEEN] = QUEEN,   [WHITE_KING] = KING,     [BLACK_KING] = KING,
+};
+
+static inline PieceType Piece_type(Piece piece) { return PIECE_TYPES[(uint8_t)piece]; }
+
 int Piece_value_at(Piece piece, int i) {
     switch (piece) {
         case WHITE_PAWN:
@@ -429,6 +766,7 @@ class {
 Move;
 
 #define MAX_LEGAL_MOVES 218
+#define MOVE_NONE ((Move){0, 0, NO_PROMOTION})  // Before the root and after a null move
 
 char* Move_string(Move* move) {
     static char buffer[6];
@@ -476,6 +814,7 @@ typedef uint8_t gamestate_t;
 #define Z_HASH_STACK_SIZE 1024
 class {
     uint64_t hashes[Z_HASH_STACK_SIZE];
+    uint8_t halfmoves[Z_HASH_STACK_SIZE];  // Clock before the move that pushed the hash
     int sp;
 }
 ZHashStack;
@@ -522,7 +861,6 @@ class {
     int pawn_row_sum;          // Sum pawn rows to use in final eval calculation
     bitboard_t bb_white;       // Bitboard of all white pieces
     bitboard_t bb_black;       // Bitboard of all black pieces
-    Move killer_moves[2][64];  // Used for move ordering [id][depth]
     bool white_has_castled;
     bool black_has_castled;
     uint8_t number_of_pawns;
@@ -878,6 +1216,7 @@ Piece Chess_make_move(Chess* chess, Move* move) {
 
     // Update halfmove clock
     // Reset if a pawn moved or a capture was made
+    chess->zhstack.halfmoves[chess->zhstack.sp] = chess->halfmoves;
     if (!Piece_is_pawn(moving_piece) && target_piece == EMPTY) {
         chess->halfmoves++;
     } else {
@@ -1146,14 +1485,8 @@ void Chess_unmake_move(Chess* chess, Move* move, Piece capture) {
         }
     }
 
-    // Update halfmove clock
-    // Reset if a pawn moved or a capture was made
-    // TODO: this aint working
-    if (!Piece_is_pawn(moving_piece) && capture == EMPTY) {
-        chess->halfmoves--;
-    } else {
-        chess->halfmoves = 0;
-    }
+    // Restore the halfmove clock
+    chess->halfmoves = chess->zhstack.halfmoves[chess->zhstack.sp];
 
     // Update fullmove number
     if (chess->turn == TURN_BLACK) {
@@ -1170,15 +1503,16 @@ gamestate_t Chess_make_null_move(Chess* chess) {
     chess->zhash ^= ZHASH_WHITE ^ ZHASH_BLACK;
     chess->turn = !chess->turn;
 
-    // Push zhash
+    // Push zhash, no position before a null move can be repeated after it
+    chess->zhstack.halfmoves[chess->zhstack.sp] = chess->halfmoves;
+    chess->halfmoves = 0;
     ZHashStack_push(&chess->zhstack, chess->zhash);
-
-    // No need to update half move or full move clock since it won't matter much
     return gamestate;
 }
 
 void Chess_unmake_null_move(Chess* chess, gamestate_t gamestate) {
     ZHashStack_pop(&chess->zhstack);
+    chess->halfmoves = chess->zhstack.halfmoves[chess->zhstack.sp];
 
     chess->zhash ^= ZHASH_STATE[chess->gamestate] ^ ZHASH_STATE[gamestate];
     chess->gamestate = gamestate;
@@ -2110,6 +2444,119 @@ size_t Chess_legal_moves(Chess* chess, Move* moves, bool captures_only) {
     return n_moves;
 }
 
+// Attack sets of the non sliding pieces, shifted with the wrapped files masked out
+#define BB_NOT_A 0xfefefefefefefefeULL
+#define BB_NOT_AB 0xfcfcfcfcfcfcfcfcULL
+#define BB_NOT_H 0x7f7f7f7f7f7f7f7fULL
+#define BB_NOT_GH 0x3f3f3f3f3f3f3f3fULL
+
+static inline bitboard_t bitboard_knight_attacks(int i) {
+    bitboard_t b = bitboard_from_index(i);
+    return ((b << 17) & BB_NOT_A) | ((b << 15) & BB_NOT_H) | ((b << 10) & BB_NOT_AB) |
+           ((b << 6) & BB_NOT_GH) | ((b >> 17) & BB_NOT_H) | ((b >> 15) & BB_NOT_A) |
+           ((b >> 10) & BB_NOT_GH) | ((b >> 6) & BB_NOT_AB);
+}
+
+static inline bitboard_t bitboard_king_attacks(int i) {
+    bitboard_t b = bitboard_from_index(i);
+    bitboard_t row = b | ((b << 1) & BB_NOT_A) | ((b >> 1) & BB_NOT_H);
+    return (row | (row << 8) | (row >> 8)) & ~b;
+}
+
+static inline bitboard_t bitboard_rook_attacks(int i, bitboard_t occupied) {
+    int index = ((occupied & bitboard_rook_mask(i)) * ROOK_MAGIC_NUMS[i]) >> ROOK_MAGIC_SHIFTS[i];
+    return ROOK_MOVES[i][index];
+}
+
+static inline bitboard_t bitboard_bishop_attacks(int i, bitboard_t occupied) {
+    int index =
+        ((occupied & bitboard_bishop_mask(i)) * BISHOP_MAGIC_NUMS[i]) >> BISHOP_MAGIC_SHIFTS[i];
+    return BISHOP_MOVES[i][index];
+}
+
+// Squares of 'candidates' that hold a piece of type t1 or t2
+static inline bitboard_t Chess_of_types(Chess* chess, bitboard_t candidates, PieceType t1,
+                                        PieceType t2) {
+    bitboard_t found = 0;
+    for (; candidates; candidates &= candidates - 1) {
+        int j = __builtin_ctzll(candidates);
+        PieceType type = Piece_type(chess->board[j]);
+        if (type == t1 || type == t2) found |= bitboard_from_index(j);
+    }
+    return found;
+}
+
+// Pieces of both colors in 'occupied' that attack square i
+static bitboard_t Chess_attackers_to(Chess* chess, int i, bitboard_t occupied) {
+    bitboard_t b = bitboard_from_index(i);
+    bitboard_t attackers =
+        Chess_of_types(chess, bitboard_rook_attacks(i, occupied) & occupied, ROOK, QUEEN) |
+        Chess_of_types(chess, bitboard_bishop_attacks(i, occupied) & occupied, BISHOP, QUEEN) |
+        Chess_of_types(chess, bitboard_knight_attacks(i) & occupied, KNIGHT, KNIGHT) |
+        Chess_of_types(chess, bitboard_king_attacks(i) & occupied, KING, KING);
+
+    // A white pawn attacks i from one row below, a black pawn from one row above
+    bitboard_t white_pawns = ((b >> 9) & BB_NOT_H) | ((b >> 7) & BB_NOT_A);
+    bitboard_t black_pawns = ((b << 7) & BB_NOT_H) | ((b << 9) & BB_NOT_A);
+    attackers |= Chess_of_types(chess, white_pawns & chess->bb_white & occupied, PAWN, PAWN);
+    attackers |= Chess_of_types(chess, black_pawns & chess->bb_black & occupied, PAWN, PAWN);
+    return attackers;
+}
+
+// The king can only take last, it is worth more than everything else together
+static const int SEE_VALUES[6] = {PAWN_VALUE,      KNIGHT_VALUE, BISHOP_VALUE,
+                                  ROOK_VALUE,      QUEEN_VALUE,  20000};
+
+// Static exchange evaluation: material won by the side to move when both sides keep
+// recapturing on the target square with their least valuable attacker (pins are ignored)
+int Chess_see(Chess* chess, Move* move) {
+    int gain[32];
+    int d = 0;
+    int to = move->to;
+    bitboard_t occupied = chess->bb_white | chess->bb_black;
+    bitboard_t attackers = Chess_attackers_to(chess, to, occupied);
+    bitboard_t from_bb = bitboard_from_index(move->from);
+    PieceType attacker_type = Piece_type(chess->board[move->from]);
+    turn_t turn = chess->turn;
+
+    gain[0] = SEE_VALUES[Piece_type(chess->board[to])];
+    do {
+        // Score if the piece that just took is taken back
+        d++;
+        gain[d] = SEE_VALUES[attacker_type] - gain[d - 1];
+
+        // Taking the attacker away discovers the sliders behind it
+        occupied ^= from_bb;
+        attackers &= occupied;
+        if (attacker_type == PAWN || attacker_type == BISHOP || attacker_type == QUEEN) {
+            attackers |= Chess_of_types(chess, bitboard_bishop_attacks(to, occupied) & occupied,
+                                        BISHOP, QUEEN);
+        }
+        if (attacker_type == ROOK || attacker_type == QUEEN) {
+            attackers |= Chess_of_types(chess, bitboard_rook_attacks(to, occupied) & occupied,
+                                        ROOK, QUEEN);
+        }
+
+        // Least valuable attacker of the other side
+        turn = !turn;
+        bitboard_t side = attackers & (turn == TURN_WHITE ? chess->bb_white : chess->bb_black);
+        from_bb = 0;
+        attacker_type = KING + 1;
+        for (; side; side &= side - 1) {
+            int j = __builtin_ctzll(side);
+            PieceType type = Piece_type(chess->board[j]);
+            if (type < attacker_type) {
+                from_bb = bitboard_from_index(j);
+                attacker_type = type;
+            }
+        }
+    } while (from_bb && d < 31);
+
+    // Either side stops taking when it would lose by going on
+    while (--d) gain[d - 1] = -(-gain[d - 1] > gain[d] ? -gain[d - 1] : gain[d]);
+    return gain[0];
+}
+
 void Chess_score_move(Chess* chess, Move* move, int* score) {
     // Give very high scores to promotions
     if unlikely (move->promotion == PROMOTE_QUEEN) {
@@ -2177,6 +2624,27 @@ static inline void select_best_move(Move* moves, int* scores, int start, int n_m
     }
 }
 
+// Same, but a capture of a cheaper piece that loses material (SEE) goes after the quiet
+// moves, at a score below -LOSING_CAPTURE_MALUS / 2
+// The exchange is only evaluated when the capture comes up, most nodes cut off before
+// The TT and PV moves keep their place, whatever the exchange
+static inline void select_best_move_see(Chess* chess, Move* moves, int* scores, int start,
+                                        int n_moves) {
+    while (1) {
+        select_best_move(moves, scores, start, n_moves);
+        Move* move = &moves[start];
+        Piece victim = chess->board[move->to];
+        if (victim == EMPTY || scores[start] < -LOSING_CAPTURE_MALUS / 2) return;
+        if (scores[start] >= TT_MOVE_BONUS / 2) return;
+        if (abs(Piece_value(chess->board[move->from])) <= abs(Piece_value(victim))) return;
+        if (move->promotion == PROMOTE_QUEEN || Chess_see(chess, move) >= 0) return;
+
+        // Below the threshold the capture is not evaluated again when it comes back up
+        scores[start] -= LOSING_CAPTURE_MALUS;
+        if (scores[start] >= -LOSING_CAPTURE_MALUS / 2) scores[start] = -LOSING_CAPTURE_MALUS;
+    }
+}
+
 bool Chess_equal(Chess* chess, char* board_fen) {
     for (int i = 0; i < 64; i++) {
         if (chess->board[i] != board_fen[i]) return false;
@@ -2184,20 +2652,51 @@ bool Chess_equal(Chess* chess, char* board_fen) {
     return true;
 }
 
+// Perft transposition table
+// Every slot stores (key ^ data) next to data, so a torn write from another
+// thread fails the key check on the next probe instead of returning bad counts.
+class {
+    _Atomic uint64_t key;   // zobrist hash ^ data
+    _Atomic uint64_t data;  // nodes << 8 | depth
+}
+PerftItem;
+
+// Will give ~32MB array
+#define PERFT_TT_LENGTH (1 << 21)
+
+PerftItem* perft_tt = NULL;
+
+static inline PerftItem* PerftTT_slot(uint64_t hash, int depth) {
+    return &perft_tt[(hash ^ (depth * 0x9E3779B97F4A7C15ULL)) & (PERFT_TT_LENGTH - 1)];
+}
+
+static inline bool PerftTT_get(uint64_t hash, int depth, size_t* nodes) {
+    PerftItem* item = PerftTT_slot(hash, depth);
+    uint64_t data = atomic_load_explicit(&item->data, memory_order_relaxed);
+    uint64_t key = atomic_load_explicit(&item->key, memory_order_relaxed);
+    if ((key ^ data) != hash || (data & 0xFF) != (uint64_t)depth) return false;
+    *nodes = data >> 8;
+    return true;
+}
+
+static inline void PerftTT_store(uint64_t hash, int depth, size_t nodes) {
+    PerftItem* item = PerftTT_slot(hash, depth);
+    uint64_t data = ((uint64_t)nodes << 8) | (uint64_t)depth;
+    atomic_store_explicit(&item->data, data, memory_order_relaxed);
+    atomic_store_explicit(&item->key, hash ^ data, memory_order_relaxed);
+}
+
 size_t Chess_count_moves(Chess* chess, int depth) {
     if (depth == 0) return 1;
 
+    // Moves are only generated on a miss, depth 1 counts are not stored
+    size_t nodes = 0;
+    if (perft_tt && depth > 1 && PerftTT_get(chess->zhash, depth, &nodes)) return nodes;
+
     Move moves[MAX_LEGAL_MOVES];
     size_t n_moves = Chess_legal_moves(chess, moves, false);
-    // if (n_moves == 32 && chess->board[54] == WHITE_BISHOP) {
-    //     printf("%lu ", (unsigned long)n_moves);
-    //     Chess_print_fen(chess);
-    //     Chess_print(chess);
-    //     Chess_dump(chess);
-    // }
     if (depth == 1) return n_moves;
 
-    size_t nodes = 0;
     for (int i = 0; i < n_moves; i++) {
         gamestate_t gamestate = chess->gamestate;
         uint64_t hash = chess->zhash;
@@ -2212,6 +2711,7 @@ size_t Chess_count_moves(Chess* chess, int depth) {
         chess->bb_black = bb_black;
     }
 
+    if (perft_tt) PerftTT_store(chess->zhash, depth, nodes);
     return nodes;
 }
 
@@ -2219,8 +2719,11 @@ int Chess_3fold_repetition(Chess* chess) {
     uint64_t hash = ZHashStack_peek(&chess->zhstack);
     int count = 1;
 
-    // Loop through the stack backwards
-    for (int i = chess->zhstack.sp - 2; i >= 0; i--) {
+    // Only the positions since the last capture or pawn move with the same side to move
+    // can be the same, loop through them backwards
+    int end = chess->zhstack.sp - 1 - chess->halfmoves;
+    if (end < 0) end = 0;
+    for (int i = chess->zhstack.sp - 3; i >= end; i -= 2) {
         if (chess->zhstack.hashes[i] == hash) {
             count++;
             if (count >= 3) return 3;
@@ -2230,72 +2733,214 @@ int Chess_3fold_repetition(Chess* chess) {
     return count;
 }
 
-size_t nodes_total = 0;
-pthread_mutex_t lock;
-class {
-    Chess chess;
-    int depth;
-    Move move;
-    TIME_TYPE endtime;
-    int* score;
-    bool* search_cancelled;
+// Cuckoo tables of the reversible moves, from Marcel van Kervinck's cycle detection
+// A knight, bishop, rook, queen or king move between two squares changes the hash by
+// the key of the piece on both squares and the side key. The 3668 keys are stored with
+// cuckoo hashing, so a hash difference is looked up in two slots.
+#define CUCKOO_SIZE 8192
+#define CUCKOO_H1(key) ((key) & (CUCKOO_SIZE - 1))
+#define CUCKOO_H2(key) (((key) >> 16) & (CUCKOO_SIZE - 1))
+
+uint64_t cuckoo_keys[CUCKOO_SIZE];
+Move cuckoo_moves[CUCKOO_SIZE];
+bitboard_t cuckoo_between[CUCKOO_SIZE];  // Squares the move goes over
+
+void cuckoo_init(void) {
+    static const Piece PIECES[] = {WHITE_KNIGHT, WHITE_BISHOP, WHITE_ROOK, WHITE_QUEEN,
+                                   WHITE_KING,   BLACK_KNIGHT, BLACK_BISHOP, BLACK_ROOK,
+                                   BLACK_QUEEN,  BLACK_KING};
+    for (int p = 0; p < sizeof(PIECES) / sizeof(PIECES[0]); p++) {
+        PieceType type = Piece_type(PIECES[p]);
+        for (int s1 = 0; s1 < 64; s1++) {
+            for (int s2 = s1 + 1; s2 < 64; s2++) {
+                bitboard_t b1 = bitboard_from_index(s1), b2 = bitboard_from_index(s2);
+                bitboard_t between = 0;
+                bool reaches;
+                if (type == KNIGHT) {
+                    reaches = bitboard_knight_attacks(s1) & b2;
+                } else if (type == KING) {
+                    reaches = bitboard_king_attacks(s1) & b2;
+                } else if (bitboard_rook_attacks(s1, 0) & b2) {
+                    reaches = type != BISHOP;
+                    between = bitboard_rook_attacks(s1, b2) & bitboard_rook_attacks(s2, b1);
+                } else if (bitboard_bishop_attacks(s1, 0) & b2) {
+                    reaches = type != ROOK;
+                    between = bitboard_bishop_attacks(s1, b2) & bitboard_bishop_attacks(s2, b1);
+                } else {
+                    reaches = false;
+                }
+                if (!reaches) continue;
+
+                // Insert, pushing the entry out of the slot into its other slot
+                uint64_t key = Piece_zhash_at(PIECES[p], s1) ^ Piece_zhash_at(PIECES[p], s2) ^
+                               ZHASH_WHITE ^ ZHASH_BLACK;
+                Move move = {s1, s2, NO_PROMOTION};
+                size_t i = CUCKOO_H1(key);
+                while (1) {
+                    uint64_t k = cuckoo_keys[i];
+                    Move m = cuckoo_moves[i];
+                    bitboard_t bw = cuckoo_between[i];
+                    cuckoo_keys[i] = key;
+                    cuckoo_moves[i] = move;
+                    cuckoo_between[i] = between;
+                    if (k == 0) break;
+                    key = k;
+                    move = m;
+                    between = bw;
+                    i = i == CUCKOO_H1(key) ? CUCKOO_H2(key) : CUCKOO_H1(key);
+                }
+            }
+        }
+    }
 }
-ChessThread;
 
-void* Chess_count_moves_thread(void* arg_void) {
-    ChessThread* arg = (ChessThread*)arg_void;
-    Chess* chess = &arg->chess;
-    int depth = arg->depth;
-    Move* move = &arg->move;
+// True if the side to move has a move to a position of the reversible part of the game,
+// so that the node can be scored as at least a draw before the repetition happens
+// Within the search tree one repetition is enough, before it the position must already
+// have been seen twice
+bool Chess_upcoming_repetition(Chess* chess, int ply) {
+    ZHashStack* zhstack = &chess->zhstack;
+    int end = chess->halfmoves < zhstack->sp - 1 ? chess->halfmoves : zhstack->sp - 1;
+    if (end < 3) return false;
 
-    Chess_make_move(chess, move);
-    size_t nodes = Chess_count_moves(chess, depth - 1);
+    uint64_t hash = zhstack->hashes[zhstack->sp - 1];
+    bitboard_t occupied = chess->bb_white | chess->bb_black;
+    for (int i = 3; i <= end; i += 2) {
+        uint64_t other = zhstack->hashes[zhstack->sp - 1 - i];
+        uint64_t key = hash ^ other;
+        size_t j = CUCKOO_H1(key);
+        if (cuckoo_keys[j] != key) {
+            j = CUCKOO_H2(key);
+            if (cuckoo_keys[j] != key) continue;
+        }
+        if (cuckoo_between[j] & occupied) continue;
+
+        // The piece to move back belongs to the side to move
+        Move* move = &cuckoo_moves[j];
+        Piece piece = chess->board[move->from] != EMPTY ? chess->board[move->from]
+                                                         : chess->board[move->to];
+        if (Piece_is_white(piece) != (chess->turn == TURN_WHITE)) continue;
+        if (ply > i) return true;
+        for (int k = i + 2; k <= end; k += 2) {
+            if (zhstack->hashes[zhstack->sp - 1 - k] == other) return true;
+        }
+    }
+    return false;
+}
 
-    pthread_mutex_lock(&lock);    // enter critical section
-    nodes_total += nodes;         // update shared variable
-    pthread_mutex_unlock(&lock);  // leave critical section
+// Parallel perft
+// The tree is split two plies below the root (one task per root move and reply)
+// so a single heavy root move still spreads over every worker. Workers claim
+// the next task with an atomic counter until the list is exhausted.
+class {
+    uint8_t root_index;  // Index of the root move this subtree belongs to
+    Move moves[2];       // Moves leading from the root to the subtree
+    uint8_t n_moves;     // Number of moves in 'moves' (1 or 2)
+}
+PerftTask;
 
-    return NULL;
+class {
+    Chess* root;
+    int depth;
+    PerftTask* tasks;
+    size_t n_tasks;
+    atomic_size_t next;
+    _Atomic uint64_t* divide;  // Nodes per root move
 }
+PerftJob;
 
-size_t Chess_count_moves_multi(Chess* chess, int depth) {
-    Move moves[MAX_LEGAL_MOVES];
-    size_t n_moves = Chess_legal_moves(chess, moves, false);
-    nodes_total = 0;
+void Chess_count_moves_thread(void* arg, int worker) {
+    PerftJob* job = (PerftJob*)arg;
+    Chess* chess = malloc(sizeof(Chess));
+    memcpy(chess, job->root, sizeof(Chess));
+
+    while (1) {
+        size_t t = atomic_fetch_add(&job->next, 1);
+        if (t >= job->n_tasks) break;
+        PerftTask* task = &job->tasks[t];
+
+        gamestate_t gamestates[2];
+        uint64_t hashes[2];
+        bitboard_t bbs_white[2], bbs_black[2];
+        Piece captures[2];
+        for (int i = 0; i < task->n_moves; i++) {
+            gamestates[i] = chess->gamestate;
+            hashes[i] = chess->zhash;
+            bbs_white[i] = chess->bb_white;
+            bbs_black[i] = chess->bb_black;
+            captures[i] = Chess_make_move(chess, &task->moves[i]);
+        }
 
-    pthread_t* threads = calloc(n_moves, sizeof(pthread_t));
-    ChessThread* args = calloc(n_moves, sizeof(ChessThread));
+        size_t nodes = Chess_count_moves(chess, job->depth - task->n_moves);
+        atomic_fetch_add(&job->divide[task->root_index], nodes);
 
-    // Initialize the mutex
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        perror("mutex init failed");
-        return 1;
+        for (int i = task->n_moves - 1; i >= 0; i--) {
+            Chess_unmake_move(chess, &task->moves[i], captures[i]);
+            chess->gamestate = gamestates[i];
+            chess->zhash = hashes[i];
+            chess->bb_white = bbs_white[i];
+            chess->bb_black = bbs_black[i];
+        }
     }
 
-    // Create threads
+    free(chess);
+}
+
+// Count the leaf nodes at 'depth' using every core
+// If 'divide' is not NULL, it receives the node count of each root move
+size_t Chess_count_moves_multi(Chess* chess, int depth, Move* root_moves, size_t* divide) {
+    size_t n_moves = Chess_legal_moves(chess, root_moves, false);
+    size_t total = 0;
+
+    if (!perft_tt) perft_tt = calloc(PERFT_TT_LENGTH, sizeof(PerftItem));
+
+    // Split below the root
+    PerftTask* tasks = malloc(n_moves * MAX_LEGAL_MOVES * sizeof(PerftTask));
+    size_t n_tasks = 0;
     for (int i = 0; i < n_moves; i++) {
-        ChessThread* arg = &args[i];
-        arg->depth = depth;
-        memcpy(&arg->chess, chess, sizeof(Chess));
-        memcpy(&arg->move, &moves[i], sizeof(Move));
+        if (depth < 3) {
+            tasks[n_tasks++] = (PerftTask){.root_index = i, .moves = {root_moves[i]}, .n_moves = 1};
+            continue;
+        }
 
-        if (pthread_create(&threads[i], NULL, Chess_count_moves_thread, arg) != 0) {
-            perror("pthread_create failed");
-            return 1;
+        gamestate_t gamestate = chess->gamestate;
+        uint64_t hash = chess->zhash;
+        bitboard_t bb_white = chess->bb_white;
+        bitboard_t bb_black = chess->bb_black;
+        Piece capture = Chess_make_move(chess, &root_moves[i]);
+
+        Move replies[MAX_LEGAL_MOVES];
+        size_t n_replies = Chess_legal_moves(chess, replies, false);
+        for (int j = 0; j < n_replies; j++) {
+            tasks[n_tasks++] = (PerftTask){
+                .root_index = i, .moves = {root_moves[i], replies[j]}, .n_moves = 2};
         }
+
+        Chess_unmake_move(chess, &root_moves[i], capture);
+        chess->gamestate = gamestate;
+        chess->zhash = hash;
+        chess->bb_white = bb_white;
+        chess->bb_black = bb_black;
     }
 
-    // Wait for threads to finish
+    PerftJob job = {.root = chess, .depth = depth, .tasks = tasks, .n_tasks = n_tasks};
+    atomic_init(&job.next, 0);
+    job.divide = calloc(n_moves > 0 ? n_moves : 1, sizeof(*job.divide));
+
+    // Never more workers than tasks
+    int n_threads = default_threads();
+    if (n_threads > n_tasks) n_threads = n_tasks > 0 ? n_tasks : 1;
+    pool_run(n_threads, Chess_count_moves_thread, &job);
+
     for (int i = 0; i < n_moves; i++) {
-        pthread_join(threads[i], NULL);
+        size_t nodes = atomic_load(&job.divide[i]);
+        if (divide) divide[i] = nodes;
+        total += nodes;
     }
 
-    // Clean up
-    pthread_mutex_destroy(&lock);
-    free(threads);
-    free(args);
-
-    return nodes_total;
+    free(tasks);
+    free(job.divide);
+    return total;
 }
 
 typedef void (*task_fn)(void*);
@@ -2305,132 +2950,326 @@ typedef struct {
     bool reached;
 } result_t;
 
+// Principal variation of a root move, the root move first
+#define MAX_PV 64
+
+typedef struct {
+    int depth;  // Depth of the search that found it, 0 if none yet
+    int length;
+    Move moves[MAX_PV];
+} RootLine;
+
+// Search of one root move to 'depth', the worker rebuilds the position from task_stack.root
 typedef struct {
-    Chess chess;
-    int depth;
-    Piece capture;
     Move move;
-    int move_index;
-    result_t* result;
+    uint8_t move_index;  // Index in results
+    uint8_t depth;
     bool dont_push_next;
 } task_t;
 
+// Scheduler tracing with --trace <file>, written as Chrome trace-event JSON
+// (Perfetto, about:tracing)
+// Every thread owns a ring buffer that keeps its last TRACE_BUFFER_SIZE events
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+typedef enum {
+    TRACE_TASK,        // A task was searched, arg is the number of follow-up tasks pushed
+    TRACE_DISCARDED,   // A task was abandoned because the time ran out
+    TRACE_QUEUE_WAIT,  // Sleeping on not_empty in task_pop
+    TRACE_POP,         // Selecting a task in task_pop, arg is the number of failed CAS
+    TRACE_PUSH,        // Queueing a task in task_push, arg is the number of failed CAS
+} TraceKind;
+
+class {
+    uint64_t start;  // Microseconds since trace_start
+    uint32_t duration;
+    int16_t arg;
+    uint8_t kind;  // TraceKind
+    uint8_t depth;
+    uint8_t from;
+    uint8_t to;
+}
+TraceEvent;
+
+class {
+    TraceEvent* events;
+    uint64_t n_events;  // Events ever recorded, only the last TRACE_BUFFER_SIZE are kept
+} __attribute__((aligned(64)))
+TraceBuffer;
+
+// NULL unless --trace, slots are used like search_stats
+TraceBuffer* trace_buffers = NULL;
+static _Thread_local TraceBuffer* trace = NULL;
+char* trace_filename = NULL;
+uint64_t trace_start = 0;
+
+// The coarse TIME_NOW() clock is too slow moving for lock hold times
+static inline uint64_t trace_clock_us(void) {
+#ifdef _WIN32
+    return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Returns 0 when not tracing so that the call sites stay cheap
+static inline uint64_t trace_now(void) {
+    if likely (trace == NULL) return 0;
+    return trace_clock_us() - trace_start;
+}
+
+static inline void trace_event(TraceKind kind, uint64_t start, task_t* task, int arg) {
+    if likely (trace == NULL) return;
+    uint64_t end = trace_now();
+    TraceEvent* e = &trace->events[trace->n_events++ % TRACE_BUFFER_SIZE];
+    e->start = start;
+    e->duration = (uint32_t)(end - start);
+    e->arg = (int16_t)arg;
+    e->kind = kind;
+    e->depth = task ? task->depth : 0;
+    e->from = task ? task->move.from : 0;
+    e->to = task ? task->move.to : 0;
+}
+
+// Give the calling thread its ring buffer, slot 0 is the main thread
+void trace_thread(int slot) {
+    if (!trace_buffers) return;
+    TraceBuffer* buffer = &trace_buffers[slot];
+    if (!buffer->events) buffer->events = calloc(TRACE_BUFFER_SIZE, sizeof(TraceEvent));
+    trace = buffer->events ? buffer : NULL;
+}
+
+void trace_init(char* filename) {
+    trace_filename = filename;
+    trace_buffers = calloc(MAX_THREADS + 1, sizeof(TraceBuffer));
+    trace_start = trace_clock_us();
+    trace_thread(0);
+}
+
+// Write all the ring buffers to trace_filename, registered with atexit()
+void trace_dump(void) {
+    static const char* names[] = {"task", "discarded", "queue wait", "task_pop", "task_push"};
+    FILE* f = fopen(trace_filename, "w");
+    if (!f) {
+        perror(trace_filename);
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+               "\"args\": {\"name\": \"sigma-zero\"}}");
+    uint64_t dropped = 0;
+    for (int t = 0; t <= MAX_THREADS; t++) {
+        TraceBuffer* buffer = &trace_buffers[t];
+        if (!buffer->events) continue;
+        char thread_name[16] = "main";
+        if (t > 0) snprintf(thread_name, sizeof(thread_name), "worker %d", t - 1);
+        fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                   "\"args\": {\"name\": \"%s\"}}",
+                t, thread_name);
+
+        uint64_t first =
+            buffer->n_events > TRACE_BUFFER_SIZE ? buffer->n_events - TRACE_BUFFER_SIZE : 0;
+        dropped += first;
+        for (uint64_t i = first; i < buffer->n_events; i++) {
+            TraceEvent* e = &buffer->events[i % TRACE_BUFFER_SIZE];
+            const char* name = names[e->kind];
+            char task_name[16];
+            if (e->kind == TRACE_TASK || e->kind == TRACE_DISCARDED) {
+                Move move = {.from = e->from, .to = e->to};
+                snprintf(task_name, sizeof(task_name), "%s d%d", Move_string(&move), e->depth);
+                name = e->kind == TRACE_TASK ? task_name : name;
+            }
+
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                       "\"tid\": %d, \"ts\": %" PRIu64 ", \"dur\": %u",
+                    name, e->kind <= TRACE_DISCARDED ? "task" : "scheduler", t, e->start,
+                    e->duration);
+            if (e->kind == TRACE_TASK) {
+                fprintf(f, ", \"args\": {\"pushes\": %d, \"duplicate_pushes\": %d}", e->arg,
+                        e->arg > 1 ? e->arg - 1 : 0);
+            } else if (e->kind == TRACE_POP || e->kind == TRACE_PUSH) {
+                fprintf(f, ", \"args\": {\"cas_retries\": %d}", e->arg);
+            } else if (e->kind == TRACE_DISCARDED) {
+                fprintf(f, ", \"args\": {\"task\": \"%s d%d\"}",
+                        Move_string(&(Move){.from = e->from, .to = e->to}), e->depth);
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n], \"otherData\": {\"dropped_events\": %" PRIu64 "}}\n", dropped);
+    fclose(f);
+}
+
+// Task scheduler of the root split search
+//
+// Queued tasks live in 'slots'. A slot index is in the free list or in one of the
+// TASK_BUCKETS buckets, which are Treiber stacks popped in bucket order:
+//   bucket 0:              depth 1 tasks, always done first
+//   bucket depth:          tasks of a line in the top priority_lines at depth - 1
+//   bucket 64 + depth:     the other tasks, lowest depth first
+// 'nonempty' has a bit per bucket, so push and pop are O(1) and lock-free. The mutex
+// is only used by idle workers going to sleep and by the pushes that wake them up.
 #define QUEUE_CAPACITY 1024
+#define TASK_BUCKETS 128
+#define TASK_NONE 0xffffffffu
+
+// Stack heads pack a slot index with a tag that changes on every update (ABA)
+#define HEAD_INDEX(head) ((uint32_t)(head))
+#define HEAD_NEXT(head, index) ((((head) >> 32) + 1) << 32 | (uint32_t)(index))
 
 struct {
+    const Chess* root;        // Read only during the search
     result_t (*results)[64];  // results[n_moves][64]
+    RootLine* lines;          // lines[n_moves], the deepest line found for each root move
+    pthread_mutex_t results_mutex;  // Guards results and lines, for writers and readers alike
     int n_moves;
-    task_t tasks[QUEUE_CAPACITY];
-    int sp;
-
+    int n_threads;
+    int max_depth;  // Deepest task that will be pushed
+    int priority_lines;  // PRIORITY_LINES, or more to keep all the multi-PV lines deepening
+
+    task_t slots[QUEUE_CAPACITY];
+    _Atomic uint32_t next[QUEUE_CAPACITY];  // Next slot in the same stack, relaxed accesses
+    _Atomic uint64_t free;
+    _Atomic uint64_t buckets[TASK_BUCKETS];
+    _Atomic uint64_t nonempty[TASK_BUCKETS / 64];
+
+    atomic_int queued;  // Counted before a task is visible and after it is taken
+    atomic_int sleepers;
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
-    pthread_cond_t not_full;
     atomic_bool stop;
     atomic_size_t active_workers;
-} task_stack;
+} task_stack = {.results_mutex = PTHREAD_MUTEX_INITIALIZER,
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .not_empty = PTHREAD_COND_INITIALIZER};
 
-void task_init(result_t (*results)[64], int n_moves) {
-    task_stack.sp = 0;
+void task_init(const Chess* root, result_t (*results)[64], RootLine* lines, int n_moves,
+               int n_threads, int max_depth, int multipv) {
+    task_stack.root = root;
     task_stack.results = results;
+    task_stack.lines = lines;
     task_stack.n_moves = n_moves;
-    task_stack.stop = false;
+    task_stack.n_threads = n_threads;
+    assert(max_depth < 64);  // A root move has 64 results
+    task_stack.max_depth = max_depth;
+    task_stack.priority_lines = multipv > PRIORITY_LINES ? multipv : PRIORITY_LINES;
+    for (uint32_t i = 0; i < QUEUE_CAPACITY; i++) {
+        uint32_t next = i + 1 < QUEUE_CAPACITY ? i + 1 : TASK_NONE;
+        atomic_store_explicit(&task_stack.next[i], next, memory_order_relaxed);
+    }
+    atomic_store(&task_stack.free, 0);
+    for (int i = 0; i < TASK_BUCKETS; i++) atomic_store(&task_stack.buckets[i], TASK_NONE);
+    for (int i = 0; i < TASK_BUCKETS / 64; i++) atomic_store(&task_stack.nonempty[i], 0);
+    atomic_store(&task_stack.queued, 0);
+    atomic_store(&task_stack.sleepers, 0);
+    atomic_store(&task_stack.stop, false);
     atomic_store(&task_stack.active_workers, 0);
-    pthread_mutex_init(&task_stack.mutex, NULL);
-    pthread_cond_init(&task_stack.not_empty, NULL);
-    pthread_cond_init(&task_stack.not_full, NULL);
-}
-
-void task_destroy(void) {
-    pthread_mutex_destroy(&task_stack.mutex);
-    pthread_cond_destroy(&task_stack.not_empty);
-    pthread_cond_destroy(&task_stack.not_full);
 }
 
 static inline void task_request_stop(void) {
     atomic_store(&task_stack.stop, true);
+    pthread_mutex_lock(&task_stack.mutex);
     pthread_cond_broadcast(&task_stack.not_empty);
-    pthread_cond_broadcast(&task_stack.not_full);
-}
-
-void task_show(void) {
-    printf("{");
-    for (int i = 0; i < task_stack.sp; i++) {
-        task_t task = task_stack.tasks[i];
-        printf("%s(%d)", Move_string(&task.move), task.depth);
-        if (i + 1 != task_stack.sp) printf(", ");
-    }
-    printf("}\n");
+    pthread_mutex_unlock(&task_stack.mutex);
 }
 
-void task_push(task_t task) {
-    pthread_mutex_lock(&task_stack.mutex);
-
-    while (task_stack.sp >= QUEUE_CAPACITY && !atomic_load(&task_stack.stop)) {
-        pthread_cond_wait(&task_stack.not_full, &task_stack.mutex);
-    }
-    if (atomic_load(&task_stack.stop)) {
-        pthread_mutex_unlock(&task_stack.mutex);
-        return;
-    }
-
-    task_stack.tasks[task_stack.sp++] = task;
-    // task_show();
+// Set when the search has to end now, every search thread unwinds on it
+// Polled with a relaxed load in the nodes instead of reading the clock
+atomic_bool search_stop = false;
 
-    pthread_cond_signal(&task_stack.not_empty);
-    pthread_mutex_unlock(&task_stack.mutex);
+static inline bool search_stopped(void) {
+    return atomic_load_explicit(&search_stop, memory_order_relaxed);
 }
 
-size_t task_size(void) {
-    pthread_mutex_lock(&task_stack.mutex);
-    size_t sz = (size_t)task_stack.sp;
-    pthread_mutex_unlock(&task_stack.mutex);
-    return sz;
+static inline void search_request_stop(void) {
+    atomic_store(&search_stop, true);
+    task_request_stop();
 }
 
-size_t task_max_pushes(void) {
-    pthread_mutex_lock(&task_stack.mutex);
-    if (task_stack.n_moves > cpu_count()) {
-        pthread_mutex_unlock(&task_stack.mutex);
-        return 1;
-    }
+// Sets search_stop at the deadline so that the search threads never look at the clock
+// Started on first use and then kept, like the worker pool
+struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool armed;
+    TIME_TYPE endtime;
+} timer = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
 
-    size_t max_pushes = (cpu_count() - task_stack.active_workers) / task_stack.n_moves + 1;
-    // printf("workers: %zu/%d, max_pushes: %zu\n", task_stack.active_workers, cpu_count(),
-    //        max_pushes);
-    pthread_mutex_unlock(&task_stack.mutex);
-    return max_pushes;
+static void* timer_thread(void* arg) {
+    pthread_mutex_lock(&timer.mutex);
+    while (1) {
+        if (!timer.armed) {
+            pthread_cond_wait(&timer.cond, &timer.mutex);
+            continue;
+        }
+        TIME_TYPE now = TIME_NOW();
+        if (now >= timer.endtime) {
+            // Under the timer mutex so that a disarmed timer can't stop the next search
+            timer.armed = false;
+            search_request_stop();
+            continue;
+        }
+
+        // Wait on the wall clock, re-armed or disarmed timers wake us up early
+        double remaining = TIME_DIFF_S(timer.endtime, now);
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        uint64_t nanos = (uint64_t)ts.tv_nsec + (uint64_t)(remaining * 1e9) + 1;
+        ts.tv_sec += nanos / 1000000000;
+        ts.tv_nsec = nanos % 1000000000;
+        pthread_cond_timedwait(&timer.cond, &timer.mutex, &ts);
+    }
+    return NULL;
 }
 
-void task_maybe_stop_if_idle(void) {
-    usleep(1000);
-    if (atomic_load(&task_stack.active_workers) == 0 && task_size() == 0) {
-        task_request_stop();
+void timer_arm(TIME_TYPE endtime) {
+    pthread_mutex_lock(&timer.mutex);
+    if (!timer.started) {
+        pthread_create(&timer.thread, NULL, timer_thread, NULL);
+        pthread_detach(timer.thread);
+        timer.started = true;
     }
+    timer.endtime = endtime;
+    timer.armed = true;
+    pthread_cond_signal(&timer.cond);
+    pthread_mutex_unlock(&timer.mutex);
 }
 
-void task_remove(int index) {
-    if (index >= task_stack.sp) return;
+void timer_disarm(void) {
+    pthread_mutex_lock(&timer.mutex);
+    timer.armed = false;
+    pthread_cond_signal(&timer.cond);
+    pthread_mutex_unlock(&timer.mutex);
+}
 
-    for (int i = index; i + 1 < task_stack.sp; i++) {
-        task_stack.tasks[i] = task_stack.tasks[i + 1];
+static void stack_push(_Atomic uint64_t* stack, uint32_t index, int* retries) {
+    uint64_t head = atomic_load(stack);
+    while (1) {
+        atomic_store_explicit(&task_stack.next[index], HEAD_INDEX(head), memory_order_relaxed);
+        if (atomic_compare_exchange_weak(stack, &head, HEAD_NEXT(head, index))) break;
+        ++*retries;
     }
-    task_stack.sp--;
 }
 
-// Returns true if found a task at depth 1
-bool task_find_depth_1(task_t* task) {
-    for (int i = 0; i < task_stack.sp; i++) {
-        task_t t = task_stack.tasks[i];
-        if (t.depth <= 1) {
-            *task = t;
-            task_remove(i);
-            return true;
-        }
+// Returns TASK_NONE if the stack is empty
+static uint32_t stack_pop(_Atomic uint64_t* stack, int* retries) {
+    uint64_t head = atomic_load(stack);
+    while (HEAD_INDEX(head) != TASK_NONE) {
+        // next[] may be stale if the slot was taken meanwhile, the tag makes the CAS fail then
+        uint32_t next =
+            atomic_load_explicit(&task_stack.next[HEAD_INDEX(head)], memory_order_relaxed);
+        if (atomic_compare_exchange_weak(stack, &head, HEAD_NEXT(head, next))) break;
+        ++*retries;
     }
-    return false;
+    return HEAD_INDEX(head);
 }
 
+// Called with task_stack.results_mutex held
 bool task_is_priority(int depth, int score) {
     int better_count = 0, total_count = 0;
 
@@ -2442,78 +3281,137 @@ bool task_is_priority(int depth, int score) {
 
         if (other.score > score) {
             better_count++;
-            if (better_count >= PRIORITY_LINES) {
-                return false;  // This move is not in top PRIORITY_LINES
+            if (better_count >= task_stack.priority_lines) {
+                return false;  // This move is not in top priority_lines
             }
         }
     }
 
-    return total_count >= PRIORITY_LINES;  // This move is in top PRIORITY_LINES
+    return total_count >= task_stack.priority_lines;  // This move is in top priority_lines
 }
 
-int task_find_best(bool priority_line) {
-    int best_score = -INF, best_index = -1, best_depth = INF;
+// The priority of a line is decided when its task is pushed, from the results known then
+static int task_bucket(task_t* task) {
+    if (task->depth <= 1) return 0;
+    pthread_mutex_lock(&task_stack.results_mutex);
+    result_t previous = task_stack.results[task->move_index][task->depth - 1];
+    bool priority = previous.reached && task_is_priority(task->depth - 1, previous.score);
+    pthread_mutex_unlock(&task_stack.results_mutex);
+    return priority ? task->depth : 64 + task->depth;
+}
 
-    for (int i = 0; i < task_stack.sp; i++) {
-        task_t t = task_stack.tasks[i];
-        result_t result = task_stack.results[t.move_index][t.depth - 1];
-        int score = result.reached ? result.score : -INF;
+void task_push(task_t task) {
+    uint64_t start = trace_now();
+    int retries = 0;
+    uint32_t slot;
+    while ((slot = stack_pop(&task_stack.free, &retries)) == TASK_NONE) {
+        if (atomic_load(&task_stack.stop)) return;
+        sched_yield();  // Queue full, wait for a worker to take a task
+    }
+    if (atomic_load(&task_stack.stop)) {
+        stack_push(&task_stack.free, slot, &retries);
+        return;
+    }
 
-        if (t.depth > best_depth) continue;
-        if (priority_line && !result.reached) continue;
-        if (priority_line && !task_is_priority(t.depth - 1, score)) continue;
+    int bucket = task_bucket(&task);
+    task_stack.slots[slot] = task;
+    atomic_fetch_add(&task_stack.queued, 1);
+    stack_push(&task_stack.buckets[bucket], slot, &retries);
+    atomic_fetch_or(&task_stack.nonempty[bucket / 64], 1ull << (bucket % 64));
+    trace_event(TRACE_PUSH, start, NULL, retries);
 
-        if (t.depth < best_depth || score > best_score) {
-            best_depth = t.depth;
-            best_index = i;
-            best_score = score;
-        }
+    if (atomic_load(&task_stack.sleepers) > 0) {
+        pthread_mutex_lock(&task_stack.mutex);
+        pthread_cond_signal(&task_stack.not_empty);
+        pthread_mutex_unlock(&task_stack.mutex);
     }
-
-    return best_index;
 }
 
-// Will return true if there is time left
-bool task_pop(task_t* task, TIME_TYPE endtime) {
-    pthread_mutex_lock(&task_stack.mutex);
-
-    while (task_stack.sp == 0 && !atomic_load(&task_stack.stop)) {
-        // Wake up either when there is work or when time is up
-        pthread_cond_wait(&task_stack.not_empty, &task_stack.mutex);
-        if (TIME_NOW() > endtime) {
-            task_request_stop();
+// Take the task of the first non-empty bucket, returns false if none was found
+static bool task_take(task_t* task, int* retries) {
+    while (atomic_load(&task_stack.queued) > 0) {
+        int bucket = -1;
+        for (int i = 0; i < TASK_BUCKETS / 64 && bucket < 0; i++) {
+            uint64_t bits = atomic_load(&task_stack.nonempty[i]);
+            if (bits) bucket = i * 64 + __builtin_ctzll(bits);
+        }
+        if (bucket < 0) continue;  // A push is between 'queued' and its bucket bit
+
+        _Atomic uint64_t* stack = &task_stack.buckets[bucket];
+        uint32_t slot = stack_pop(stack, retries);
+        if (slot == TASK_NONE) {
+            // Clear the bit, then set it again if a push slipped in before the clear
+            uint64_t bit = 1ull << (bucket % 64);
+            atomic_fetch_and(&task_stack.nonempty[bucket / 64], ~bit);
+            if (HEAD_INDEX(atomic_load(stack)) != TASK_NONE) {
+                atomic_fetch_or(&task_stack.nonempty[bucket / 64], bit);
+            }
+            continue;
         }
-    }
-
-    if (task_stack.sp == 0) {
-        pthread_mutex_unlock(&task_stack.mutex);
-        return false;  // nothing to do / stopping
-    }
 
-    // Complete all depth 1 tasks.
-    if (task_find_depth_1(task)) {
-        atomic_fetch_add(&task_stack.active_workers, 1);
-        pthread_cond_signal(&task_stack.not_full);
-        pthread_mutex_unlock(&task_stack.mutex);
+        *task = task_stack.slots[slot];
+        atomic_fetch_sub(&task_stack.queued, 1);
+        stack_push(&task_stack.free, slot, retries);
         return true;
     }
+    return false;
+}
+
+size_t task_max_pushes(void) {
+    if (task_stack.n_moves > task_stack.n_threads) return 1;
 
-    // Loop through all the tasks and find the lowest depth and best previous score at that depth.
-    int i = task_find_best(false);
+    // The calling worker is still counted in active_workers
+    size_t idle_workers = task_stack.n_threads - atomic_load(&task_stack.active_workers) + 1;
+    size_t max_pushes = idle_workers / task_stack.n_moves + 1;
+    return max_pushes;
+}
+
+// Mark the calling worker's task as finished (after pushing its follow-up tasks)
+// and stop the search if nobody is working and nothing is queued anymore
+void task_done(void) {
+    if (atomic_fetch_sub(&task_stack.active_workers, 1) == 1 &&
+        atomic_load(&task_stack.queued) == 0) {
+        task_request_stop();
+    }
+}
 
-    // Loop through all the tasks and find the lowest depth where the score of the previous depth is
-    // within the top PRIORITY_LINES best scores. Otherwise, do the task found in the previous step.
-    int i2 = task_find_best(true);
+bool split_help(void);
+bool split_available(void);
 
-    if (i2 != -1) i = i2;
-    // if (i2 != -1) printf("%s\n", Move_string(&task_stack.tasks[i].move));
-    *task = task_stack.tasks[i];
-    task_remove(i);
+// Will return true if there is time left
+bool task_pop(task_t* task) {
+    uint64_t start = trace_now();
+    int retries = 0;
 
-    atomic_fetch_add(&task_stack.active_workers, 1);
-    pthread_cond_signal(&task_stack.not_full);
-    pthread_mutex_unlock(&task_stack.mutex);
-    return TIME_NOW() < endtime;
+    while (!atomic_load(&task_stack.stop)) {
+        // Counted as active first so that task_done never sees an idle search with work in flight
+        atomic_fetch_add(&task_stack.active_workers, 1);
+        if (task_take(task, &retries)) {
+            trace_event(TRACE_POP, start, task, retries);
+            bool time_left = !search_stopped();
+            if (!time_left) trace_event(TRACE_DISCARDED, trace_now(), task, 0);
+            return time_left;
+        }
+        task_done();
+
+        // No task left, join the search of a split point if there is one
+        if (split_help()) continue;
+
+        // Sleep until a push, a split point or a stop
+        // 'sleepers' is raised before 'queued' and the split points are checked again
+        uint64_t wait_start = trace_now();
+        pthread_mutex_lock(&task_stack.mutex);
+        atomic_fetch_add(&task_stack.sleepers, 1);
+        if (atomic_load(&task_stack.queued) == 0 && !split_available() &&
+            !atomic_load(&task_stack.stop)) {
+            pthread_cond_wait(&task_stack.not_empty, &task_stack.mutex);
+        }
+        atomic_fetch_sub(&task_stack.sleepers, 1);
+        pthread_mutex_unlock(&task_stack.mutex);
+        trace_event(TRACE_QUEUE_WAIT, wait_start, NULL, 0);
+        start = trace_now();
+    }
+    return false;  // nothing to do / stopping
 }
 
 // Transposition table
@@ -2529,24 +3427,47 @@ class {
 }
 TTItem;
 
-// Will give ~64MB array
-#define TT_LENGTH (1 << 22)
+// Default size gives a ~64MB array
+#define TT_DEFAULT_MB 64
+
+// Transposition table array, allocated by TT_resize()
+TTItem* tt = NULL;
+size_t tt_length = 0;
+size_t tt_mask = 0;
+
+// Allocate the largest power of two number of entries that fits in 'mb' megabytes
+// Returns false if the allocation failed (the previous table is kept)
+bool TT_resize(size_t mb) {
+    size_t length = 1;
+    while (length * 2 * sizeof(TTItem) <= mb * 1024 * 1024) length *= 2;
 
-// Transposition table array
-TTItem tt[TT_LENGTH] = {0};
+    TTItem* table = calloc(length, sizeof(TTItem));
+    if (!table) return false;
 
-// Store an entry with fine-grained locking
+    free(tt);
+    tt = table;
+    tt_length = length;
+    tt_mask = length - 1;
+    return true;
+}
+
+void TT_clear(void) { memset(tt, 0, tt_length * sizeof(TTItem)); }
+
+// Depth of an entry: 0 for an empty slot, 1..QUIES_DEPTH for quiescence by the quiescence
+// depth left, and above that the main search, so that any main entry answers quiescence
+#define TT_DEPTH(depth) ((depth) + QUIES_DEPTH)
+
+// Store an entry of the main search at 'depth' (at least 1) with fine-grained locking
 static inline int TT_store(uint64_t key, int eval, int depth, TTNodeType node_type,
                            uint8_t best_from, uint8_t best_to) {
-    size_t i = key & (TT_LENGTH - 1);
+    size_t i = key & tt_mask;
     TTItem* item = &tt[i];
+    depth = TT_DEPTH(depth);
 
-#ifdef TRACK_TT
-    atomic_fetch_add(&tt_stores, 1);
-    if (item->depth > 0 && item->key != key) {
-        atomic_fetch_add(&tt_collisions, 1);
+    if unlikely (stats_enabled) {
+        stats->tt_stores++;
+        if (item->depth > 0 && item->key != key) stats->tt_collisions++;
     }
-#endif
 
     if (depth > item->depth) {
         item->key = key;
@@ -2560,14 +3481,35 @@ static inline int TT_store(uint64_t key, int eval, int depth, TTNodeType node_ty
     return eval;
 }
 
-// Retrieve an entry with fine-grained locking
-static inline bool TT_get(uint64_t key, int* eval_p, int depth, int a, int b) {
-    size_t i = key & (TT_LENGTH - 1);
+// Quiescence entries only take empty slots and other quiescence entries
+static inline int TT_store_qsearch(uint64_t key, int eval, int depth, TTNodeType node_type,
+                                   Move* best) {
+    size_t i = key & tt_mask;
     TTItem* item = &tt[i];
 
-#ifdef TRACK_TT
-    atomic_fetch_add(&tt_lookups, 1);
-#endif
+    if unlikely (stats_enabled) {
+        stats->tt_stores++;
+        if (item->depth > 0 && item->key != key) stats->tt_collisions++;
+    }
+
+    if (item->depth <= QUIES_DEPTH) {
+        item->key = key;
+        item->eval = eval;
+        item->depth = depth;
+        item->type = node_type;
+        item->best_from = best ? best->from : 0;
+        item->best_to = best ? best->to : 0;
+    }
+
+    return eval;
+}
+
+// Retrieve an entry of at least 'depth' as stored in TTItem with fine-grained locking
+static inline bool TT_get_entry(uint64_t key, int* eval_p, int depth, int a, int b) {
+    size_t i = key & tt_mask;
+    TTItem* item = &tt[i];
+
+    STATS_ADD(tt_probes, 1);
 
     if (item->key == key && depth <= item->depth) {
         switch (item->type) {
@@ -2581,9 +3523,7 @@ static inline bool TT_get(uint64_t key, int* eval_p, int depth, int a, int b) {
                 break;
         }
 
-#ifdef TRACK_TT
-        atomic_fetch_add(&tt_hits, 1);
-#endif
+        STATS_ADD(tt_hits, 1);
         *eval_p = item->eval;
         return true;
     }
@@ -2591,23 +3531,47 @@ static inline bool TT_get(uint64_t key, int* eval_p, int depth, int a, int b) {
     return false;
 }
 
+static inline bool TT_get(uint64_t key, int* eval_p, int depth, int a, int b) {
+    return TT_get_entry(key, eval_p, TT_DEPTH(depth), a, b);
+}
+
+// A quiescence node with 'depth' left takes deeper quiescence entries and main entries
+static inline bool TT_get_qsearch(uint64_t key, int* eval_p, int depth, int a, int b) {
+    return TT_get_entry(key, eval_p, depth, a, b);
+}
+
 double TT_occupancy(void) {
     size_t tt_use = 0;
 
-    for (int i = 0; i < TT_LENGTH; i++) {
+    for (size_t i = 0; i < tt_length; i++) {
         TTItem item = tt[i];
-        if (i == (item.key & (TT_LENGTH - 1))) tt_use++;
+        if (i == (item.key & tt_mask)) tt_use++;
     }
 
-    return (double)tt_use / TT_LENGTH;
+    return (double)tt_use / tt_length;
 }
 
-int moves(char* fen, int depth) {
+// Permille of used entries, sampled over the first 1000 slots like UCI hashfull
+int TT_hashfull(void) {
+    size_t samples = tt_length < 1000 ? tt_length : 1000;
+    int used = 0;
+
+    for (size_t i = 0; i < samples; i++) {
+        if (tt[i].depth > 0) used++;
+    }
+
+    return (int)(used * 1000 / samples);
+}
+
+// Perft at 'depth', with the node count of every root move if 'divide' is set
+int moves(char* fen, int depth, bool divide) {
     Chess* chess = Chess_from_fen(fen);
     if (!chess) return 1;
-    if (depth > 1) {
+    if (depth > 1 || (divide && depth == 1)) {
+        Move root_moves[MAX_LEGAL_MOVES];
+        size_t root_nodes[MAX_LEGAL_MOVES];
         TIME_TYPE start = TIME_NOW();
-        size_t n_moves = Chess_count_moves_multi(chess, depth);
+        size_t n_moves = Chess_count_moves_multi(chess, depth, root_moves, root_nodes);
         TIME_TYPE end = TIME_NOW();
         double cpu_time = TIME_DIFF_S(end, start);
         double nps = cpu_time > 0.0 ? n_moves / cpu_time : -0.0;
@@ -2615,7 +3579,16 @@ int moves(char* fen, int depth) {
         printf("  \"depth\": %d,\n", depth);
         printf("  \"nodes\": %lu,\n", (unsigned long)n_moves);
         printf("  \"time\": %.3lf,\n", cpu_time);
-        printf("  \"nps\": %.3lf\n", nps);
+        printf("  \"nps\": %.3lf%s\n", nps, divide ? "," : "");
+        if (divide) {
+            size_t n_root_moves = Chess_legal_moves(chess, root_moves, false);
+            puts("  \"divide\": {");
+            for (int i = 0; i < n_root_moves; i++) {
+                printf("    \"%s\": %lu%s\n", Move_string(&root_moves[i]),
+                       (unsigned long)root_nodes[i], i + 1 < n_root_moves ? "," : "");
+            }
+            puts("  }");
+        }
         puts("}");
     } else {
         Move moves[MAX_LEGAL_MOVES];
@@ -2636,6 +3609,82 @@ int moves(char* fen, int depth) {
     return 0;
 }
 
+// Run every "<FEN> ;D<depth> <nodes> ..." line of an EPD file through perft
+// Depths above 'max_depth' are skipped (0 means no limit)
+// Returns 0 if every count matches, 1 otherwise
+int perft_suite(char* filename, int max_depth) {
+    FILE* f = fopen(filename, "rt");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open file: %s\n", filename);
+        return 1;
+    }
+
+    char line[1024];
+    Move root_moves[MAX_LEGAL_MOVES];
+    int positions = 0, passed = 0, failed = 0;
+    size_t total_nodes = 0;
+    TIME_TYPE start = TIME_NOW();
+    puts("{");
+    puts("  \"failures\": [");
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#' || line[0] == 0) continue;
+
+        char* saveptr;
+        char* fen = strtok_r(line, ";", &saveptr);
+        if (!fen) continue;
+        for (char* end = fen + strlen(fen); end > fen && isspace(end[-1]); end--) end[-1] = 0;
+        positions++;
+
+        char* field;
+        while ((field = strtok_r(NULL, ";", &saveptr))) {
+            int depth;
+            unsigned long long expected;
+            if (sscanf(field, " D%d %llu", &depth, &expected) != 2) continue;
+            if (max_depth > 0 && depth > max_depth) continue;
+
+            // Chess_from_fen tokenizes its argument in place
+            char fen_copy[256];
+            snprintf(fen_copy, sizeof(fen_copy), "%s", fen);
+            Chess* chess = Chess_from_fen(fen_copy);
+            if (!chess) {
+                printf("%s    {\"fen\": \"%s\", \"depth\": %d, \"error\": \"invalid FEN\"}",
+                       failed > 0 ? ",\n" : "", fen, depth);
+                failed++;
+                continue;
+            }
+
+            size_t nodes = Chess_count_moves_multi(chess, depth, root_moves, NULL);
+            total_nodes += nodes;
+            free(chess);
+
+            if (nodes == expected) {
+                passed++;
+            } else {
+                printf("%s    {\"fen\": \"%s\", \"depth\": %d, \"expected\": %llu, \"nodes\": %lu}",
+                       failed > 0 ? ",\n" : "", fen, depth, expected, (unsigned long)nodes);
+                failed++;
+            }
+        }
+    }
+    fclose(f);
+
+    TIME_TYPE end = TIME_NOW();
+    double cpu_time = TIME_DIFF_S(end, start);
+    double nps = cpu_time > 0.0 ? total_nodes / cpu_time : -0.0;
+    if (failed > 0) puts("");
+    puts("  ],");
+    printf("  \"positions\": %d,\n", positions);
+    printf("  \"passed\": %d,\n", passed);
+    printf("  \"failed\": %d,\n", failed);
+    printf("  \"nodes\": %lu,\n", (unsigned long)total_nodes);
+    printf("  \"time\": %.3lf,\n", cpu_time);
+    printf("  \"nps\": %.3lf\n", nps);
+    puts("}");
+    return failed > 0;
+}
+
 int Chess_king_mobility(Chess* chess, bool is_white, int king_i, bool only_attacks) {
     bitboard_t friendly_bb = is_white ? chess->bb_white : chess->bb_black;
     bitboard_t enemy_bb = is_white ? chess->bb_black : chess->bb_white;
@@ -2713,33 +3762,111 @@ int eval(Chess* chess) {
     return e;
 }
 
-int minimax_captures_only(Chess* chess, TIME_TYPE endtime, int depth, int a, int b) {
+// What a thread knows about one ply of the line it is searching
+// Entries are indexed by the distance to the root, ss - 1 is the parent node
+#define MAX_PLY 128
+
+class {
+    int ply;
+    int static_eval;   // Side to move point of view, -INF when in check
+    Move move;         // Move made from this node, MOVE_NONE for a null move
+    Move killers[2];   // Quiet moves that caused a beta cutoff at this ply
+    Move excluded;     // Move skipped by the search of this node
+    bool on_pv;        // The moves from the root to this node follow the previous line
+    int pv_length;
+    Move pv[MAX_PLY];  // Best line from this node, filled when a move raises alpha
+}
+SearchStack;
+
+// Two entries before the root so that ss - 2 is always valid
+SearchStack search_stacks[MAX_THREADS + 1][MAX_PLY + 4];
+static _Thread_local SearchStack* search_stack = search_stacks[0];
+
+// Line of the previous iteration of the root move being searched, tried first
+static _Thread_local RootLine* follow_line = NULL;
+
+// Clear the killers of this thread and return its root entry
+SearchStack* search_stack_root(void) {
+    for (int i = 0; i < MAX_PLY + 4; i++) {
+        SearchStack* entry = &search_stack[i];
+        entry->ply = i - 2;
+        entry->static_eval = -INF;
+        entry->move = MOVE_NONE;
+        entry->killers[0] = entry->killers[1] = MOVE_NONE;
+        entry->excluded = MOVE_NONE;
+        entry->on_pv = false;
+        entry->pv_length = 0;
+    }
+    search_stack[2].on_pv = follow_line != NULL;
+    return &search_stack[2];
+}
+
+// A node is on the previous line when its parent is and the move to it is the next one
+static inline bool SearchStack_on_pv(SearchStack* ss) {
+    SearchStack* parent = ss - 1;
+    return parent->on_pv && follow_line != NULL && parent->ply < follow_line->length &&
+           Move_equals(&parent->move, &follow_line->moves[parent->ply]);
+}
+
+// Make 'move' the line from ss, followed by the line of the child node
+static inline void SearchStack_update_pv(SearchStack* ss, Move* move) {
+    ss->pv[0] = *move;
+    memcpy(ss->pv + 1, (ss + 1)->pv, (ss + 1)->pv_length * sizeof(Move));
+    ss->pv_length = (ss + 1)->pv_length + 1;
+}
+
+int minimax_captures_only(Chess* chess, SearchStack* ss, int depth, int a, int b) {
+    stats->nodes++;
+    stats->qnodes++;
+    ss->ply = (ss - 1)->ply + 1;
+    ss->pv_length = 0;
+
+    uint64_t hash = chess->zhash;
+    int tt_eval;
+    if (depth > 0 && TT_get_qsearch(hash, &tt_eval, depth, a, b)) return tt_eval;
+
     int best_score = chess->turn == TURN_WHITE ? eval(chess) : -eval(chess);
 
     // Stand Pat
-    if (depth == 0 || best_score >= b) {
+    if (depth == 0 || best_score >= b || ss->ply >= MAX_PLY - 1) {
         // nodes_total++;
         return best_score;
     }
+    int original_a = a;
     if (best_score > a) a = best_score;
 
     Move moves[MAX_LEGAL_MOVES];
     int scores[MAX_LEGAL_MOVES];
     size_t n_moves = Chess_legal_moves_scored(chess, moves, scores, true);
 
+    // Try the move of the TT entry first
+    TTItem* tt_item = &tt[hash & tt_mask];
+    if (tt_item->key == hash) {
+        for (int i = 0; i < n_moves; i++) {
+            if (moves[i].from == tt_item->best_from && moves[i].to == tt_item->best_to) {
+                scores[i] += TT_MOVE_BONUS;
+                break;
+            }
+        }
+    }
+
+    Move* best_move = NULL;
     for (int i = 0; i < n_moves; i++) {
-        if (i < SELECT_MOVE_CUTOFF) select_best_move(moves, scores, i, n_moves);
+        select_best_move_see(chess, moves, scores, i, n_moves);
         Move* move = &moves[i];
 
+        // Only losing captures are left, they can't raise the stand pat score
+        if (scores[i] < -LOSING_CAPTURE_MALUS / 2) break;
+
         gamestate_t gamestate = chess->gamestate;
-        uint64_t hash = chess->zhash;
         int e = chess->eval;
         int pawn_row_sum = chess->pawn_row_sum;
         bitboard_t bb_white = chess->bb_white;
         bitboard_t bb_black = chess->bb_black;
         Piece capture = Chess_make_move(chess, move);
+        ss->move = *move;
 
-        int score = -minimax_captures_only(chess, endtime, depth - 1, -b, -a);
+        int score = -minimax_captures_only(chess, ss + 1, depth - 1, -b, -a);
 
         Chess_unmake_move(chess, move, capture);
         chess->gamestate = gamestate;
@@ -2751,33 +3878,383 @@ int minimax_captures_only(Chess* chess, TIME_TYPE endtime, int depth, int a, int
 
         if (score > best_score) {
             best_score = score;
-            if (score > a) a = score;
+            best_move = move;
+            if (score > a) {
+                a = score;
+                SearchStack_update_pv(ss, move);
+            }
+        }
+        if (score >= b) return TT_store_qsearch(hash, best_score, depth, TT_LOWER, best_move);
+    }
+    return TT_store_qsearch(hash, best_score, depth,
+                            best_score > original_a ? TT_EXACT : TT_UPPER, best_move);
+}
+
+// Move ordering statistics of one thread, kept over all the tasks of a search
+// Entries move toward +-HISTORY_MAX with gravity: the closer they are, the less they move
+#define HISTORY_MAX 16384
+
+class {
+    int16_t butterfly[2][64][64];     // Quiet moves [turn][from][to]
+    int16_t captures[2][6][64][6];    // Captures [turn][aggressor type][to][victim type]
+    Move counter_moves[64][64];       // Quiet refutation of the previous move [from][to]
+}
+MoveHistory;
+
+MoveHistory move_histories[MAX_THREADS + 1];
+static _Thread_local MoveHistory* move_history = &move_histories[0];
+
+static inline int16_t* MoveHistory_entry(MoveHistory* h, Chess* chess, Move* move) {
+    Piece victim = chess->board[move->to];
+    if likely (victim == EMPTY) return &h->butterfly[chess->turn][move->from][move->to];
+    int aggressor = Piece_type(chess->board[move->from]);
+    return &h->captures[chess->turn][aggressor][move->to][Piece_type(victim)];
+}
+
+static inline void MoveHistory_add(int16_t* entry, int bonus) {
+    *entry += bonus - *entry * abs(bonus) / HISTORY_MAX;
+}
+
+// Reward the move that failed high and punish the moves of the same kind searched before it
+// Quiet moves also become a killer and the counter move of the previous move
+static void MoveHistory_cutoff(Chess* chess, SearchStack* ss, Move* tried, int n_tried,
+                               Move* best, int depth) {
+    MoveHistory* h = move_history;
+    int bonus = depth * depth * 16;
+    if (bonus > HISTORY_MAX / 8) bonus = HISTORY_MAX / 8;
+    bool quiet = chess->board[best->to] == EMPTY;
+
+    MoveHistory_add(MoveHistory_entry(h, chess, best), bonus);
+    for (int i = 0; i < n_tried; i++) {
+        if ((chess->board[tried[i].to] == EMPTY) == quiet) {
+            MoveHistory_add(MoveHistory_entry(h, chess, &tried[i]), -bonus);
+        }
+    }
+    if (!quiet) return;
+
+    // Shift killers: move primary to secondary, new move to primary
+    if (!(ss->killers[0].from == best->from && ss->killers[0].to == best->to)) {
+        ss->killers[1] = ss->killers[0];
+        ss->killers[0] = *best;
+    }
+    Move last_move = (ss - 1)->move;
+    if (last_move.from != last_move.to) h->counter_moves[last_move.from][last_move.to] = *best;
+}
+
+// Late move reductions in 1/1024 ply, [depth][move index]
+// The nodes adjust them with the history of the move, the window and 'improving'
+// LMR_BASE, LMR_PV and LMR_NOT_IMPROVING are in the same 1/1024 ply units
+#define REDUCTION_MAX_DEPTH 64
+int16_t reductions[REDUCTION_MAX_DEPTH][MAX_LEGAL_MOVES];
+
+// log2(x) in 1/1024, linear between the powers of two
+static int log2_fixed(int x) {
+    int k = 8 * sizeof(int) - __builtin_clz(x) - 1;
+    return k * 1024 + (int)(((int64_t)(x - (1 << k)) << 10) >> k);
+}
+
+void reductions_init(void) {
+    for (int d = 1; d < REDUCTION_MAX_DEPTH; d++) {
+        for (int i = 1; i < MAX_LEGAL_MOVES; i++) {
+            int r = log2_fixed(d) * log2_fixed(i) / 1024 * 100 / LMR_DIVISOR;
+            reductions[d][i] = r > 0 ? LMR_BASE + r : 0;
+        }
+    }
+}
+
+// The static eval went up since the last move of the same side, a node in check counts
+static inline bool SearchStack_improving(SearchStack* ss) {
+    return ss->static_eval == -INF || (ss - 2)->static_eval == -INF ||
+           ss->static_eval > (ss - 2)->static_eval;
+}
+
+// Late quiet moves of a null window node that are not worth searching at low depth:
+// past the move count of the depth, or with a bad enough history
+// The moves are ordered, the later the move the less likely it is to raise alpha
+static inline bool prune_late_move(Chess* chess, SearchStack* ss, int depth, int a, int b,
+                                   Move* move, int i, bool in_check) {
+    if (i == 0 || in_check || b - a > 1 || a <= -1000000 || depth > LMP_DEPTH) return false;
+    if (chess->board[move->to] != EMPTY || move->promotion) return false;
+
+    bool improving = SearchStack_improving(ss);
+    int max_moves = (LMP_BASE + depth * depth) * (1 + improving) / 2;
+    if (i >= max_moves) {
+        stats->late_move_prunes++;
+        return true;
+    }
+    int history = *MoveHistory_entry(move_history, chess, move);
+    if (depth <= HP_DEPTH && history < -HP_MARGIN * depth) {
+        stats->history_prunes++;
+        return true;
+    }
+    return false;
+}
+
+int minimax(Chess* chess, SearchStack* ss, int depth, int a, int b, Piece last_capture,
+            int extensions);
+
+// Search the i-th move of a node: full window for the first move, then a reduced null
+// window search that is widened when it beats alpha (PVS with late move reductions)
+static inline int minimax_move(Chess* chess, SearchStack* ss, int depth, int a, int b,
+                               Move* move, int i, bool in_check, int extensions,
+                               Piece* capture_out) {
+    gamestate_t gamestate = chess->gamestate;
+    uint64_t hash = chess->zhash;
+    int e = chess->eval;
+    int pawn_row_sum = chess->pawn_row_sum;
+    bitboard_t bb_white = chess->bb_white;
+    bitboard_t bb_black = chess->bb_black;
+    int history = i > 0 ? *MoveHistory_entry(move_history, chess, move) : 0;
+    Piece capture = Chess_make_move(chess, move);
+    ss->move = *move;
+
+    int score;
+    if (i == 0) {
+        // principal variation search
+        score = -minimax(chess, ss + 1, depth - 1, -b, -a, capture, extensions);
+    } else {
+        // Late move reduction condition
+        bool reduction_condition = depth >= 2 && !in_check && capture == EMPTY;
+        int r = 0;
+        if (reduction_condition) {
+            r = reductions[depth < REDUCTION_MAX_DEPTH ? depth : REDUCTION_MAX_DEPTH - 1]
+                          [i < MAX_LEGAL_MOVES ? i : MAX_LEGAL_MOVES - 1];
+            r -= history * 1024 / LMR_HISTORY_DIVISOR;
+            if (b - a > 1) r -= LMR_PV;
+            if (!SearchStack_improving(ss)) r += LMR_NOT_IMPROVING;
+            r = r > 0 ? r / 1024 : 0;
+        }
+
+        // Reduce less aggressively in endgames
+        if (chess->fullmoves >= FULLMOVES_ENDGAME && r > 1) r = r / 2;
+
+        // Clamp reduction so we don't go below depth 1
+        int reduced_depth = depth - 1 - r;
+        if (reduced_depth < 0) reduced_depth = 0;
+
+        // search with a narrow window and reduction first
+        score = -minimax(chess, ss + 1, reduced_depth, -a - 1, -a, capture, extensions);
+
+        // if reduction caused potential improvement re-search
+        if (r > 0 && score > a) {
+            STATS_ADD(lmr_researches, 1);
+            PROFILE_ADD(depth, lmr_researches);
+            score = -minimax(chess, ss + 1, depth - 1, -a - 1, -a, capture, extensions);
+        }
+
+        // if score exceeds alpha do full search
+        if (score > a) {
+            score = -minimax(chess, ss + 1, depth - 1, -b, -a, capture, extensions);
         }
-        if (score >= b) return best_score;
     }
-    return best_score;
+
+    Chess_unmake_move(chess, move, capture);
+    chess->gamestate = gamestate;
+    chess->zhash = hash;
+    chess->eval = e;
+    chess->pawn_row_sum = pawn_row_sum;
+    chess->bb_white = bb_white;
+    chess->bb_black = bb_black;
+
+    *capture_out = capture;
+    return score;
 }
 
-static inline int compute_reduction(int depth, int i) {
-    int log_depth = 8 * sizeof(int) - __builtin_clz(depth) - 1;
-    int log_i = 8 * sizeof(int) - __builtin_clz(i) - 1;
-    return log_depth * log_i / 3;
+// Young brothers wait split points (--split)
+// Once the first move of a node is searched without a cutoff, a worker that has idle
+// workers around opens a split point with the remaining moves. The idle workers copy the
+// position and take moves from it, sharing alpha and the best score. A beta cutoff sets
+// 'cutoff', which aborts the searches below the split point and below its descendants.
+#define SPLIT_MAX_NESTING 8
+
+typedef struct SplitPoint {
+    Chess chess;
+    Move moves[MAX_LEGAL_MOVES];
+    int n_moves;
+    atomic_int next_move;
+    atomic_int alpha;
+    int beta;
+    int depth;
+    int extensions;
+    bool in_check;
+    int profile_root_sp;
+    struct SplitPoint* parent;  // Split point the owner was searching for, if any
+    // Copy of the owner's stack from ss - 2 to ss, the helpers search from the same ply
+    // stack[2].pv is the line of the best move, guarded by the mutex
+    SearchStack stack[3];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done;  // Signaled when the last helper leaves
+    bool open;            // Helpers may join
+    int helpers;
+    int best_score;
+    int best_index;
+    atomic_bool cutoff;
+} SplitPoint;
+
+bool split_enabled = false;
+// The open split point of each worker, the innermost one when they are nested
+SplitPoint* _Atomic open_splits[MAX_THREADS];
+// Split points owned by this thread, NULL outside the play threads or without --split
+static _Thread_local SplitPoint* split_stack = NULL;
+static _Thread_local int split_nesting = 0;
+static _Thread_local int split_worker = 0;
+// Innermost split point this thread is searching below
+static _Thread_local SplitPoint* active_split = NULL;
+
+// True if a split point at or above 'sp' had a beta cutoff
+static inline bool split_aborted(SplitPoint* sp) {
+    for (; sp; sp = sp->parent) {
+        if (atomic_load_explicit(&sp->cutoff, memory_order_relaxed)) return true;
+    }
+    return false;
 }
 
-int minimax(Chess* chess, TIME_TYPE endtime, int depth, int a, int b, Piece last_capture,
+// True if the score being computed will be thrown away: out of time or cut off above
+static inline bool search_aborted(void) {
+    return search_stopped() || (active_split && split_aborted(active_split));
+}
+
+static inline bool split_has_work(SplitPoint* sp) {
+    return sp && atomic_load(&sp->next_move) < sp->n_moves && !split_aborted(sp);
+}
+
+bool split_available(void) {
+    for (int i = 0; i < task_stack.n_threads; i++) {
+        if (split_has_work(atomic_load(&open_splits[i]))) return true;
+    }
+    return false;
+}
+
+// Give this worker its split points, they stay allocated with the pool thread
+void split_thread_init(int worker) {
+    split_worker = worker;
+    if (!split_enabled || split_stack) return;
+    split_stack = calloc(SPLIT_MAX_NESTING, sizeof(SplitPoint));
+    for (int i = 0; i < SPLIT_MAX_NESTING; i++) {
+        pthread_mutex_init(&split_stack[i].mutex, NULL);
+        pthread_cond_init(&split_stack[i].done, NULL);
+    }
+}
+
+// Take moves from the split point until there are none left or it is aborted
+static void split_search(SplitPoint* sp, Chess* chess, SearchStack* ss) {
+    while (!split_aborted(sp) && !search_stopped()) {
+        int i = atomic_fetch_add(&sp->next_move, 1);
+        if (i >= sp->n_moves) break;
+
+        Piece capture;
+        int a = atomic_load(&sp->alpha);
+        if (prune_late_move(chess, ss, sp->depth, a, sp->beta, &sp->moves[i], i, sp->in_check)) {
+            continue;
+        }
+        int score = minimax_move(chess, ss, sp->depth, a, sp->beta, &sp->moves[i], i,
+                                 sp->in_check, sp->extensions, &capture);
+        if (split_aborted(sp) || search_stopped()) break;
+
+        pthread_mutex_lock(&sp->mutex);
+        if (score > sp->best_score) {
+            sp->best_score = score;
+            sp->best_index = i;
+            if (score > atomic_load(&sp->alpha)) {
+                atomic_store(&sp->alpha, score);
+                SearchStack_update_pv(ss, &sp->moves[i]);
+                sp->stack[2].pv_length = ss->pv_length;
+                memcpy(sp->stack[2].pv, ss->pv, ss->pv_length * sizeof(Move));
+            }
+            if (score >= sp->beta) atomic_store(&sp->cutoff, true);
+        }
+        pthread_mutex_unlock(&sp->mutex);
+    }
+}
+
+// Search moves[first, n_moves) of a node together with the idle workers
+// best_score and best_index come in with the result of the moves before 'first'
+static void split(Chess* chess, SearchStack* ss, int depth, int a, int b, Move* moves,
+                  int first, int n_moves, bool in_check, int extensions, int* best_score,
+                  int* best_index) {
+    SplitPoint* sp = &split_stack[split_nesting++];
+    STATS_ADD(split_points, 1);
+    pthread_mutex_lock(&sp->mutex);
+    memcpy(&sp->chess, chess, sizeof(Chess));
+    memcpy(sp->moves, moves, n_moves * sizeof(Move));
+    sp->n_moves = n_moves;
+    atomic_store(&sp->next_move, first);
+    atomic_store(&sp->alpha, a);
+    sp->beta = b;
+    sp->depth = depth;
+    sp->extensions = extensions;
+    sp->in_check = in_check;
+    sp->profile_root_sp = profile_root_sp;
+    sp->parent = active_split;
+    memcpy(sp->stack, ss - 2, sizeof(sp->stack));
+    sp->open = true;
+    sp->helpers = 0;
+    sp->best_score = *best_score;
+    sp->best_index = *best_index;
+    atomic_store(&sp->cutoff, false);
+    pthread_mutex_unlock(&sp->mutex);
+
+    atomic_store(&open_splits[split_worker], sp);
+    if (atomic_load(&task_stack.sleepers) > 0) {
+        pthread_mutex_lock(&task_stack.mutex);
+        pthread_cond_broadcast(&task_stack.not_empty);
+        pthread_mutex_unlock(&task_stack.mutex);
+    }
+
+    active_split = sp;
+    split_search(sp, chess, ss);
+    active_split = sp->parent;
+
+    // Close the split point and wait for the helpers still searching its moves
+    SplitPoint* outer = split_nesting > 1 ? &split_stack[split_nesting - 2] : NULL;
+    atomic_store(&open_splits[split_worker], outer);
+    pthread_mutex_lock(&sp->mutex);
+    sp->open = false;
+    while (sp->helpers > 0) pthread_cond_wait(&sp->done, &sp->mutex);
+    *best_score = sp->best_score;
+    *best_index = sp->best_index;
+    ss->pv_length = sp->stack[2].pv_length;
+    memcpy(ss->pv, sp->stack[2].pv, ss->pv_length * sizeof(Move));
+    pthread_mutex_unlock(&sp->mutex);
+    split_nesting--;
+}
+
+int minimax(Chess* chess, SearchStack* ss, int depth, int a, int b, Piece last_capture,
             int extensions) {
-#ifdef TRACK_NODES
-    atomic_fetch_add(&nodes_searched, 1);
-#endif
+    stats->nodes++;
+    profile_node(depth, chess->zhstack.sp);
+    ss->ply = (ss - 1)->ply + 1;
+    ss->pv_length = 0;
+    ss->on_pv = SearchStack_on_pv(ss);
+
+    // Before the transposition table, which has the score of the earlier occurrence
+    if (Chess_3fold_repetition(chess) >= 3) {
+        // nodes_total++;
+        return 0;
+    }
+
+    // The side to move can repeat a position, the node is worth at least a draw
+    bool can_repeat = a < 0 && Chess_upcoming_repetition(chess, ss->ply);
+    if (can_repeat) {
+        a = 0;
+        if (a >= b) return a;
+    }
 
     if (depth == 0 && last_capture != EMPTY) {
-        return minimax_captures_only(chess, endtime, QUIES_DEPTH, a, b);
+        return minimax_captures_only(chess, ss, QUIES_DEPTH, a, b);
     }
 
     // Look for existing eval in transposition table
+    // A search without one of the moves gets its own entries
     uint64_t hash = ZHashStack_peek(&chess->zhstack);
+    bool has_excluded = ss->excluded.from != ss->excluded.to;
+    if unlikely (has_excluded) {
+        hash ^= 0x9E3779B97F4A7C15ull * (1 + ss->excluded.from * 64 + ss->excluded.to);
+    }
     int tt_eval;
     if (TT_get(hash, &tt_eval, depth, a, b)) {
+        PROFILE_ADD(depth, tt_cutoffs);
         return tt_eval;
     }
 
@@ -2787,18 +4264,18 @@ int minimax(Chess* chess, TIME_TYPE endtime, int depth, int a, int b, Piece last
             depth++;
             extensions++;
         } else {
-            return TT_store(hash, chess->turn == TURN_WHITE ? eval(chess) : -eval(chess), depth,
-                            TT_EXACT, 0, 0);
+            // Not stored, quiescence would take the static eval for a resolved score
+            int score = chess->turn == TURN_WHITE ? eval(chess) : -eval(chess);
+            return can_repeat && score < 0 ? 0 : score;
         }
     }
 
-    // Time cutoff
-    if (TIME_NOW() > endtime) return 0;
+    // Stopped, or a cutoff at a split point above
+    if unlikely (search_aborted()) return 0;
 
-    // Check for 3 fold repetition
-    if (Chess_3fold_repetition(chess) >= 3) {
-        // nodes_total++;
-        return 0;
+    // Out of stack, only reachable through long chains of check extensions
+    if unlikely (ss->ply >= MAX_PLY - 1) {
+        return chess->turn == TURN_WHITE ? eval(chess) : -eval(chess);
     }
 
     Move moves[MAX_LEGAL_MOVES];
@@ -2816,33 +4293,47 @@ int minimax(Chess* chess, TIME_TYPE endtime, int depth, int a, int b, Piece last
         }
     }
 
+    ss->static_eval = -INF;
+    if (!in_check) ss->static_eval = chess->turn == TURN_WHITE ? eval(chess) : -eval(chess);
+
     // Futility pruning
     if (!in_check && last_capture == EMPTY && depth < FP_DEPTH) {
-        int e = chess->turn == TURN_WHITE ? eval(chess) : -eval(chess);
+        int e = ss->static_eval;
         int margin = FP_BASE + depth * FP_FACTOR;
         if (e + margin <= a) {
+            STATS_ADD(futility_prunes, 1);
+            PROFILE_ADD(depth, futility_prunes);
             return TT_store(hash, a, depth, TT_UPPER, 0, 0);  // Failed low
         }
 
         margin = RFP_BASE + depth * RFP_FACTOR;
         if (e - 2 * margin >= b) {
+            STATS_ADD(reverse_futility_prunes, 1);
+            PROFILE_ADD(depth, reverse_futility_prunes);
             return TT_store(hash, b, depth, TT_LOWER, 0, 0);  // Failed high
         }
     }
 
     // Null move pruning
     bool is_null_move_allowed = extensions < MAX_EXTENSION;
-    if (!in_check && depth >= 3 && is_null_move_allowed && Chess_has_non_pawn_material(chess)) {
+    if (!in_check && depth >= 3 && is_null_move_allowed && !has_excluded &&
+        Chess_has_non_pawn_material(chess)) {
         gamestate_t gamestate = Chess_make_null_move(chess);
         int R = (depth >= 6) ? 3 : 2;
-        int score = -minimax(chess, endtime, depth - 1 - R, -b, -b + 1, EMPTY, MAX_EXTENSION);
+        ss->move = MOVE_NONE;
+        int score = -minimax(chess, ss + 1, depth - 1 - R, -b, -b + 1, EMPTY, MAX_EXTENSION);
         Chess_unmake_null_move(chess, gamestate);
+        if unlikely (search_aborted()) return 0;
 
-        if (score >= b) return b;  // Null move cutoff
+        if (score >= b) {
+            STATS_ADD(null_move_cutoffs, 1);
+            PROFILE_ADD(depth, null_move_cutoffs);
+            return b;  // Null move cutoff
+        }
     }
 
     // Prioritize TT best move
-    size_t tt_i = hash & (TT_LENGTH - 1);
+    size_t tt_i = hash & tt_mask;
     TTItem* tt_item = &tt[tt_i];
     if (tt_item->key == hash) {
         for (int i = 0; i < n_moves; i++) {
@@ -2853,105 +4344,108 @@ int minimax(Chess* chess, TIME_TYPE endtime, int depth, int a, int b, Piece last
         }
     }
 
-    // Add score for killer move heuristic
+    // The line of the previous iteration goes before the TT move, its entries may be gone
+    if (ss->on_pv && ss->ply < follow_line->length) {
+        Move* pv_move = &follow_line->moves[ss->ply];
+        for (int i = 0; i < n_moves; i++) {
+            if (Move_equals(&moves[i], pv_move)) {
+                scores[i] += 2 * TT_MOVE_BONUS;
+                break;
+            }
+        }
+    }
+
+    // Add score for killer moves, the counter move and the history of the move
+    Move last_move = (ss - 1)->move;
+    Move counter = move_history->counter_moves[last_move.from][last_move.to];
+    bool has_counter = last_move.from != last_move.to;
     for (int i = 0; i < n_moves; i++) {
         Move* move = &moves[i];
+        int history = *MoveHistory_entry(move_history, chess, move);
 
         // Check both killer slots
         if likely (chess->board[move->to] == EMPTY) {
-            bool is_killer_move = (chess->killer_moves[0][depth].from == move->from &&
-                                   chess->killer_moves[0][depth].to == move->to) ||
-                                  (chess->killer_moves[1][depth].from == move->from &&
-                                   chess->killer_moves[1][depth].to == move->to);
+            bool is_killer_move =
+                (ss->killers[0].from == move->from && ss->killers[0].to == move->to) ||
+                (ss->killers[1].from == move->from && ss->killers[1].to == move->to);
+            bool is_counter_move =
+                has_counter && counter.from == move->from && counter.to == move->to;
             scores[i] += is_killer_move * KILLER_MOVE_BONUS;
+            scores[i] += is_counter_move * COUNTER_MOVE_BONUS;
+            scores[i] += history / HISTORY_DIVISOR;
+        } else {
+            scores[i] += history / CAPTURE_HISTORY_DIVISOR;
         }
     }
 
-#ifdef TRACK_BETA_CUTOFFS
-    atomic_fetch_add(&total_nodes, 1);
-#endif
+    STATS_ADD(move_nodes, 1);
+    PROFILE_ADD(depth, move_nodes);
 
     int original_a = a;
-    int best_score = -INF;
+    int best_score = can_repeat ? 0 : -INF;  // Even if every move fails low
     Move best_move = moves[0];
+    Move tried[MAX_LEGAL_MOVES];  // Searched before the current move, pruned ones are not
+    int n_tried = 0;
     for (int i = 0; i < n_moves; i++) {
-        if (i < SELECT_MOVE_CUTOFF) select_best_move(moves, scores, i, n_moves);
+        if (i < SELECT_MOVE_CUTOFF) select_best_move_see(chess, moves, scores, i, n_moves);
         Move* move = &moves[i];
+        if unlikely (has_excluded && Move_equals(move, &ss->excluded)) continue;
+        if (prune_late_move(chess, ss, depth, a, b, move, i, in_check)) continue;
 
-        gamestate_t gamestate = chess->gamestate;
-        uint64_t hash = chess->zhash;
-        int e = chess->eval;
-        int pawn_row_sum = chess->pawn_row_sum;
-        bitboard_t bb_white = chess->bb_white;
-        bitboard_t bb_black = chess->bb_black;
-        Piece capture = Chess_make_move(chess, move);
-
-        int score;
-        if (i == 0) {
-            // principal variation search
-            score = -minimax(chess, endtime, depth - 1, -b, -a, capture, extensions);
-        } else {
-            // Late move reduction condition
-            bool reduction_condition = depth >= 2 && !in_check && capture == EMPTY;
-            int r = reduction_condition ? compute_reduction(depth, i) : 0;
-
-            // Reduce less aggressively in endgames
-            if (chess->fullmoves >= FULLMOVES_ENDGAME && r > 1) r = r / 2;
-
-            // Clamp reduction so we don't go below depth 1
-            int reduced_depth = depth - 1 - r;
-            if (reduced_depth < 0) reduced_depth = 0;
-
-            // search with a narrow window and reduction first
-            score = -minimax(chess, endtime, reduced_depth, -a - 1, -a, capture, extensions);
-
-            // if reduction caused potential improvement re-search
-            if (r > 0 && score > a) {
-                score = -minimax(chess, endtime, depth - 1, -a - 1, -a, capture, extensions);
-            }
-
-            // if score exceeds alpha do full search
-            if (score > a) {
-                score = -minimax(chess, endtime, depth - 1, -b, -a, capture, extensions);
-            }
-        }
-
-        Chess_unmake_move(chess, move, capture);
-        chess->gamestate = gamestate;
-        chess->zhash = hash;
-        chess->eval = e;
-        chess->pawn_row_sum = pawn_row_sum;
-        chess->bb_white = bb_white;
-        chess->bb_black = bb_black;
+        Piece capture;
+        int score = minimax_move(chess, ss, depth, a, b, move, i, in_check, extensions, &capture);
+        // An aborted score is meaningless, unwind without storing it
+        if unlikely (search_aborted()) return 0;
 
         if (score > best_score) {
             best_score = score;
             best_move = *move;
-            if (score > a) a = score;
+            if (score > a) {
+                a = score;
+                SearchStack_update_pv(ss, move);
+            }
         }
         if (score >= b) {
-#ifdef TRACK_BETA_CUTOFFS
-            atomic_fetch_add(&beta_cutoffs, 1);
-            atomic_fetch_add(&total_cutoff_index, i);
-            if (i == 0) atomic_fetch_add(&first_move_cutoffs, 1);
-#endif
-            if (capture == EMPTY) {
-                // Shift killers: move primary to secondary, new move to primary
-                if (!(chess->killer_moves[0][depth].from == move->from &&
-                      chess->killer_moves[0][depth].to == move->to)) {
-                    chess->killer_moves[1][depth] = chess->killer_moves[0][depth];
-                    chess->killer_moves[0][depth].from = move->from;
-                    chess->killer_moves[0][depth].to = move->to;
-                }
+            if unlikely (stats_enabled) {
+                stats->beta_cutoffs++;
+                stats->cutoff_index_sum += i;
+                if (i == 0) stats->first_move_cutoffs++;
             }
+            profile_cutoff(depth, i);
+            MoveHistory_cutoff(chess, ss, tried, n_tried, move, depth);
             return TT_store(hash, best_score, depth, TT_LOWER, best_move.from,
                             best_move.to);  // Failed high
         }
+        tried[n_tried++] = *move;
+
+        // The eldest brother is searched, let the idle workers help with the others
+        if (i == 0 && split_stack && depth >= SPLIT_MIN_DEPTH && n_moves > 2 &&
+            split_nesting < SPLIT_MAX_NESTING && atomic_load(&task_stack.sleepers) > 0) {
+            for (int j = 1; j < SELECT_MOVE_CUTOFF && j < n_moves; j++) {
+                select_best_move_see(chess, moves, scores, j, n_moves);
+            }
+            int best_index = 0;
+            split(chess, ss, depth, a, b, moves, 1, n_moves, in_check, extensions, &best_score,
+                  &best_index);
+            if (search_aborted()) return 0;
+            best_move = moves[best_index];
+
+            if (best_score >= b) {
+                STATS_ADD(beta_cutoffs, 1);
+                STATS_ADD(cutoff_index_sum, best_index);
+                profile_cutoff(depth, best_index);
+                // The helpers tried the other moves in any order, only reward the best one
+                MoveHistory_cutoff(chess, ss, moves, 0, &best_move, depth);
+                return TT_store(hash, best_score, depth, TT_LOWER, best_move.from,
+                                best_move.to);  // Failed high
+            }
+            break;
+        }
     }
 
-#ifdef TRACK_BETA_CUTOFFS
-    atomic_fetch_add(&total_cutoff_index, n_moves - 1);
-#endif
+    // Only the excluded move was legal
+    if unlikely (best_score == -INF) return a;
+
     if (best_score <= original_a) {
         return TT_store(hash, best_score, depth, TT_UPPER, best_move.from,
                         best_move.to);  // Failed low
@@ -2959,29 +4453,187 @@ int minimax(Chess* chess, TIME_TYPE endtime, int depth, int a, int b, Piece last
     return TT_store(hash, best_score, depth, TT_EXACT, best_move.from, best_move.to);
 }
 
-void* play_thread(void* arg) {
-    TIME_TYPE endtime = *(TIME_TYPE*)arg;
+// Join an open split point of another worker, returns false if there was none
+bool split_help(void) {
+    if (!split_stack) return false;
+
+    for (int w = 0; w < task_stack.n_threads; w++) {
+        SplitPoint* sp = atomic_load(&open_splits[w]);
+        if (w == split_worker || !split_has_work(sp)) continue;
+
+        pthread_mutex_lock(&sp->mutex);
+        bool joined = sp->open && split_has_work(sp);
+        if (joined) sp->helpers++;
+        pthread_mutex_unlock(&sp->mutex);
+        if (!joined) continue;
+        STATS_ADD(split_joins, 1);
+
+        // The owner keeps searching on its own position, take a copy
+        Chess* chess = malloc(sizeof(Chess));
+        memcpy(chess, &sp->chess, sizeof(Chess));
+        int root_sp = profile_root_sp;
+        profile_root_sp = sp->profile_root_sp;
+        // Between two tasks the stack of this thread is free, and it follows no line
+        follow_line = NULL;
+        SearchStack* ss = &search_stack[sp->stack[2].ply + 2];
+        memcpy(ss - 2, sp->stack, sizeof(sp->stack));
+        active_split = sp;
+        split_search(sp, chess, ss);
+        active_split = NULL;
+        profile_root_sp = root_sp;
+        free(chess);
+
+        pthread_mutex_lock(&sp->mutex);
+        if (--sp->helpers == 0) pthread_cond_signal(&sp->done);
+        pthread_mutex_unlock(&sp->mutex);
+        return true;
+    }
+    return false;
+}
+
+// Pick the best move of the deepest depth its line reached in results[n_moves][64]
+static int results_best_move(result_t (*results)[64], size_t n_moves, int* best_index,
+                             int* best_score) {
+    bool has_next = true;
+    int depth;
+    for (depth = 1; depth < 63 && has_next; depth++) {
+        *best_score = -INF;
+        for (int i = 0; i < n_moves; i++) {
+            result_t result = results[i][depth];
+            if (result.reached && result.score > *best_score) {
+                *best_score = result.score;
+                *best_index = i;
+                has_next = results[i][depth + 1].reached;
+            }
+        }
+    }
+    return depth - 1;
+}
+
+// Clock time management, the time left is split into a soft and a hard limit
+// The hard limit is left to the timer thread. The soft limit is checked whenever a
+// root result comes in, and is scaled down while the best move stays the same and up
+// when it changes or its score drops.
+#define TM_MOVES_TO_GO 30        // Moves assumed left in the game without movestogo
+#define TM_OVERHEAD_MS 20        // Kept aside for the process and the caller
+#define TM_INCREMENT_PERCENT 75  // Part of the increment spent on this move
+#define TM_SOFT_PERCENT 60       // Soft limit in percent of the base time
+#define TM_HARD_FACTOR 4         // Hard limit in base times...
+#define TM_MAX_PERCENT 40        // ...but at most this percent of the time left
+#define TM_SCORE_DROP 30         // Centipawns lost from one depth to the next that extend
+#define TM_UNSTABLE_PERCENT 150  // Soft limit scale after the best move changed
+#define TM_STABLE_STEP 20        // Taken off the scale for every stable depth
+#define TM_STABLE_MIN 50         // Smallest soft limit scale
+#define TM_DROP_PERCENT 150      // Extra scale while the score is dropping
+
+struct {
+    bool active;
+    TIME_TYPE start;
+    int soft_ms;
+    int hard_ms;
+    int depth;  // Depth of the best line at the last result
+    int best_index;
+    int best_score;
+    int stable;  // Depths in a row that kept the best move and its score
+    bool dropping;
+} time_manager;
+
+// Called with task_stack.results_mutex held after a result is stored
+static void time_manager_update(void) {
+    int best_index = 0, best_score;
+    int depth = results_best_move(task_stack.results, task_stack.n_moves, &best_index,
+                                  &best_score);
+    // The score of the best line at the previous depth, whichever move it was
+    if (depth > time_manager.depth && time_manager.best_index >= 0) {
+        time_manager.dropping = best_score < time_manager.best_score - TM_SCORE_DROP;
+    }
+    if (best_index != time_manager.best_index) {
+        time_manager.stable = 0;
+    } else if (depth > time_manager.depth) {
+        bool stable = abs(best_score - time_manager.best_score) <= TM_SCORE_DROP;
+        time_manager.stable = stable ? time_manager.stable + 1 : 0;
+    }
+    time_manager.depth = depth;
+    time_manager.best_index = best_index;
+    time_manager.best_score = best_score;
+
+    int scale = TM_UNSTABLE_PERCENT - time_manager.stable * TM_STABLE_STEP;
+    if (scale < TM_STABLE_MIN) scale = TM_STABLE_MIN;
+    if (time_manager.dropping) scale = scale * TM_DROP_PERCENT / 100;
+    double soft = (double)time_manager.soft_ms * scale / 100000;
+    if (TIME_DIFF_S(TIME_NOW(), time_manager.start) >= soft) search_request_stop();
+}
+
+// Progress of the search printed with --stream, one JSON line per depth of the best line
+// The workers post a new depth when they store a result, the thread that runs search()
+// waits for it and prints it, so that the workers never write to stdout
+struct {
+    bool enabled;
+    pthread_cond_t cond;  // Waited on with task_stack.results_mutex
+    int depth;            // Deepest depth of the best line posted
+    int workers_done;     // Workers that left play_thread
+} search_stream = {.cond = PTHREAD_COND_INITIALIZER};
+
+// Called with task_stack.results_mutex held after a result is stored
+static void search_stream_post(void) {
+    int best_index = 0, best_score;
+    int depth = results_best_move(task_stack.results, task_stack.n_moves, &best_index,
+                                  &best_score);
+    if (depth <= search_stream.depth) return;
+    search_stream.depth = depth;
+    pthread_cond_signal(&search_stream.cond);
+}
+
+void play_thread(void* arg, int worker) {
     task_t task;
     int score;
+    RootLine task_line;
+    stats = &search_stats[worker + 1];
+    move_history = &move_histories[worker + 1];
+    search_stack = search_stacks[worker + 1];
+    if (search_profiles) profile = &search_profiles[worker + 1];
+    trace_thread(worker + 1);
+    split_thread_init(worker);
+
+    // Every task makes its root move on this copy and takes it back afterwards
+    Chess* chess = malloc(sizeof(Chess));
+    memcpy(chess, task_stack.root, sizeof(Chess));
+    profile_root_sp = chess->zhstack.sp;
 
     while (1) {
-        if (!task_pop(&task, endtime)) break;
-        if (task.depth >= 64) continue;
-        Chess* chess = &task.chess;
+        if (!task_pop(&task)) break;
+        uint64_t task_start = trace_now();
         int depth = task.depth;
-        Piece capture = task.capture;
-        Move move = task.move;
-        memset(chess->killer_moves, 0, sizeof(chess->killer_moves));
+        result_t* result = &task_stack.results[task.move_index][depth];
+        RootLine* line = &task_stack.lines[task.move_index];
+
+        // Follow the deepest line of this root move found so far, and center the aspiration
+        // window on its score at the previous depth
+        pthread_mutex_lock(&task_stack.results_mutex);
+        memcpy(&task_line, line, sizeof(RootLine));
+        result_t previous = depth > 1 ? result[-1] : (result_t){0};
+        pthread_mutex_unlock(&task_stack.results_mutex);
+        follow_line = task_line.depth > 0 ? &task_line : NULL;
+        SearchStack* ss = search_stack_root();
+        ss->move = task.move;
+
+        gamestate_t gamestate = chess->gamestate;
+        uint64_t hash = chess->zhash;
+        int e = chess->eval;
+        int pawn_row_sum = chess->pawn_row_sum;
+        bitboard_t bb_white = chess->bb_white;
+        bitboard_t bb_black = chess->bb_black;
+        Piece capture = Chess_make_move(chess, &task.move);
 
-        if (task.depth > 1 && task.result[-1].reached) {  // aspiration window
+        if (previous.reached) {  // aspiration window
             int window_alpha = ASP_WINDOW_ALPHA_INIT, window_beta = ASP_WINDOW_BETA_INIT;
-            int prev_score = task.result[-1].score;
+            int prev_score = previous.score;
 
             while (1) {
                 int alpha = prev_score - window_alpha;
                 int beta = prev_score + window_beta;
-                score = -minimax(chess, endtime, depth - 1, -beta, -alpha, capture, 0);
-                if (TIME_NOW() > endtime) break;
+                score = -minimax(chess, ss + 1, depth - 1, -beta, -alpha, capture, 0);
+                if (search_stopped()) break;
                 if (score <= alpha)
                     window_alpha *= 2;
                 else if (score >= beta)
@@ -2991,42 +4643,70 @@ void* play_thread(void* arg) {
             }
 
         } else {
-            score = -minimax(chess, endtime, depth - 1, -INF, INF, capture, 0);
+            score = -minimax(chess, ss + 1, depth - 1, -INF, INF, capture, 0);
         }
 
-        if (TIME_NOW() > endtime) {
+        Chess_unmake_move(chess, &task.move, capture);
+        chess->gamestate = gamestate;
+        chess->zhash = hash;
+        chess->eval = e;
+        chess->pawn_row_sum = pawn_row_sum;
+        chess->bb_white = bb_white;
+        chess->bb_black = bb_black;
+
+        if (search_stopped()) {
+            trace_event(TRACE_DISCARDED, task_start, &task, 0);
             task_request_stop();
             break;
         }
 
         // Add move score
-        task.result->score = score;
-        task.result->reached = true;
-        atomic_fetch_sub(&task_stack.active_workers, 1);
+        pthread_mutex_lock(&task_stack.results_mutex);
+        result->score = score;
+        result->reached = true;
+        if (depth >= line->depth) {
+            SearchStack* child = ss + 1;
+            line->depth = depth;
+            line->length = child->pv_length < MAX_PV - 1 ? child->pv_length + 1 : MAX_PV;
+            line->moves[0] = task.move;
+            memcpy(line->moves + 1, child->pv, (line->length - 1) * sizeof(Move));
+        }
+        if (time_manager.active) time_manager_update();
+        if (search_stream.enabled) search_stream_post();
+        pthread_mutex_unlock(&task_stack.results_mutex);
 
         // Don't push moves that lead to checkmate
         bool is_checkmate = abs(score) >= 1000000;
-        if (is_checkmate || task.dont_push_next || task.depth >= 62) {
-            task_maybe_stop_if_idle();
+        if (is_checkmate || task.dont_push_next || depth >= task_stack.max_depth) {
+            task_done();
+            trace_event(TRACE_TASK, task_start, &task, 0);
             continue;
         }
 
         // Push the next depth to the queue
         // If there is still space push another depth, push task a second time
-        // bool push_two_tasks = task_size() < cpu_count();
         size_t max_pushes = task_max_pushes();
+        if (max_pushes > task_stack.max_depth - depth) {
+            max_pushes = task_stack.max_depth - depth;
+        }
         for (int i = 0; i < max_pushes; i++) {
-            task_t task2 = {.chess = *chess,
-                            .capture = capture,
-                            .depth = ++depth,
-                            .move = move,
+            task_t task2 = {.move = task.move,
                             .move_index = task.move_index,
-                            .result = ++task.result,
+                            .depth = depth + i + 1,
                             .dont_push_next = i + 1 < max_pushes};
             task_push(task2);
         }
+        task_done();
+        trace_event(TRACE_TASK, task_start, &task, max_pushes);
+    }
+
+    free(chess);
+    if (search_stream.enabled) {
+        pthread_mutex_lock(&task_stack.results_mutex);
+        search_stream.workers_done++;
+        pthread_cond_signal(&search_stream.cond);
+        pthread_mutex_unlock(&task_stack.results_mutex);
     }
-    return NULL;
 }
 
 bool openings_db(Chess* chess) {
@@ -3085,79 +4765,193 @@ bool openings_db(Chess* chess) {
     return false;
 }
 
-// Play a move given a FEN string
-// Returns 0 on success, 1 on error
-int play(char* fen, int millis, char* game_history) {
-    Chess* chess = Chess_from_fen(fen);
-    if (!chess) return 1;
-    if (millis < 1) return 1;
-
-    if (game_history != NULL) {
-        Chess_game_history(chess, game_history);
-    }
-
-#ifdef TRACK_BETA_CUTOFFS
-    atomic_store(&total_nodes, 0);
-    atomic_store(&beta_cutoffs, 0);
-    atomic_store(&first_move_cutoffs, 0);
-    atomic_store(&total_cutoff_index, 0);
-#endif
-
-#ifdef TRACK_TT
-    atomic_store(&tt_lookups, 0);
-    atomic_store(&tt_hits, 0);
-    atomic_store(&tt_collisions, 0);
-    atomic_store(&tt_stores, 0);
-#endif
+class {
+    int millis;     // Time limit in milliseconds (0 for no limit)
+    int depth;      // Depth limit (0 for no limit)
+    int threads;    // Number of worker threads
+    int time_left;  // Clock time in milliseconds, uses the time manager instead of millis
+    int increment;  // Clock increment per move in milliseconds
+    int movestogo;  // Moves to the next time control (0 for the rest of the game)
+    bool ponder;    // No limit until search_ponder_hit, the caller clears search_stop
+    int multipv;    // Best root moves to report, at most MAX_MULTIPV (0 for just the best)
+}
+SearchLimits;
 
-#ifdef TRACK_NODES
-    atomic_store(&nodes_searched, 0);
-#endif
+class {
+    Move move;
+    int score;  // From the point of view of the side to move
+    int depth;  // Deepest search of the move
+    RootLine line;
+}
+RootMoveResult;
 
-    if (chess->fullmoves <= 5 && openings_db(chess)) {
-        return 0;
+class {
+    Move move;
+    int score;  // From the point of view of the side to move
+    int depth;
+    RootLine line;  // Principal variation, starting with 'move'
+    uint64_t nodes;
+    double time;
+    SearchStats stats;  // Summed over the worker threads
+    int n_multipv;      // Set with limits->multipv > 1
+    RootMoveResult multipv[MAX_MULTIPV];  // Best first, 'move' leads
+}
+SearchResult;
+
+// Rank the root moves for a multi-PV report, the best move of the search first and then
+// the others by depth and score, as deeper results can't be compared with shallower ones
+static int results_rank_moves(result_t (*results)[64], RootLine* lines, Move* moves,
+                              size_t n_moves, int best_index, RootMoveResult* ranked,
+                              int k) {
+    int depths[MAX_LEGAL_MOVES];
+    for (int i = 0; i < n_moves; i++) {
+        depths[i] = 0;
+        for (int d = 1; d < 64 && results[i][d].reached; d++) depths[i] = d;
+    }
+
+    int n = 0;
+    int next = best_index;
+    while (n < k && next >= 0) {
+        ranked[n++] = (RootMoveResult){.move = moves[next],
+                                       .score = results[next][depths[next]].score,
+                                       .depth = depths[next],
+                                       .line = lines[next]};
+        depths[next] = 0;  // Taken
+        next = -1;
+        for (int i = 0; i < n_moves; i++) {
+            if (depths[i] < 1) continue;
+            if (next < 0 || depths[i] > depths[next] ||
+                (depths[i] == depths[next] &&
+                 results[i][depths[i]].score > results[next][depths[next]].score)) {
+                next = i;
+            }
+        }
     }
+    return n;
+}
+
+// Compute the soft and hard limits of a clocked search
+static void time_manager_start(SearchLimits* limits, TIME_TYPE start) {
+    int movestogo = limits->movestogo > 0 && limits->movestogo < TM_MOVES_TO_GO
+                        ? limits->movestogo
+                        : TM_MOVES_TO_GO;
+    int time_left = limits->time_left - TM_OVERHEAD_MS;
+    if (time_left < 1) time_left = 1;
+    int base = time_left / movestogo + limits->increment * TM_INCREMENT_PERCENT / 100;
+    int max_ms = movestogo == 1 ? time_left : time_left * TM_MAX_PERCENT / 100;
+
+    time_manager.hard_ms = base * TM_HARD_FACTOR < max_ms ? base * TM_HARD_FACTOR : max_ms;
+    if (time_manager.hard_ms < 1) time_manager.hard_ms = 1;
+    time_manager.soft_ms = base * TM_SOFT_PERCENT / 100;
+    if (time_manager.soft_ms > time_manager.hard_ms) time_manager.soft_ms = time_manager.hard_ms;
+    time_manager.start = start;
+    time_manager.depth = 0;
+    time_manager.best_index = -1;
+    time_manager.best_score = 0;
+    time_manager.stable = 0;
+    time_manager.dropping = false;
+    time_manager.active = true;
+}
+
+// The opponent played the move a ponder search is searching the reply to, it goes on
+// as a clock search from now on
+void search_ponder_hit(SearchLimits* limits) {
+    TIME_TYPE now = TIME_NOW();
+    pthread_mutex_lock(&task_stack.results_mutex);
+    time_manager_start(limits, now);
+    pthread_mutex_unlock(&task_stack.results_mutex);
+    timer_arm(TIME_PLUS_OFFSET_MS(now, time_manager.hard_ms));
+}
+
+// Print the depths posted by the workers of a search of 'chess' until they are all done
+static void search_stream_print(Chess* chess, Move* moves, int n_threads, TIME_TYPE start) {
+    int printed = 0;
+    RootLine line;
+    pthread_mutex_lock(&task_stack.results_mutex);
+    while (1) {
+        while (search_stream.depth == printed && search_stream.workers_done < n_threads) {
+            pthread_cond_wait(&search_stream.cond, &task_stack.results_mutex);
+        }
+        if (search_stream.depth == printed) break;
+
+        int best_index = 0, score;
+        int depth = results_best_move(task_stack.results, task_stack.n_moves, &best_index,
+                                      &score);
+        memcpy(&line, &task_stack.lines[best_index], sizeof(RootLine));
+        printed = search_stream.depth;
+        pthread_mutex_unlock(&task_stack.results_mutex);
+
+        // The node counters are read while the workers update them, close enough here
+        uint64_t nodes = 0;
+        for (int i = 1; i <= n_threads; i++) nodes += search_stats[i].nodes;
+        double time = TIME_DIFF_S(TIME_NOW(), start);
+        if (chess->turn != TURN_WHITE) score = -score;
+        printf("{\"depth\": %d, \"move\": \"%s\", \"eval\": %.2f, \"nodes\": %lu, "
+               "\"nps\": %.0lf, \"hashfull\": %d, \"time\": %.3lf, \"pv\": [",
+               depth, Move_string(&moves[best_index]), (double)score / 100,
+               (unsigned long)nodes, time > 0.0 ? (double)nodes / time : 0.0, TT_hashfull(),
+               time);
+        for (int i = 0; i < line.length; i++) {
+            printf(i > 0 ? ", \"%s\"" : "\"%s\"", Move_string(&line.moves[i]));
+        }
+        printf("]}\n");
+        fflush(stdout);
+        pthread_mutex_lock(&task_stack.results_mutex);
+    }
+    pthread_mutex_unlock(&task_stack.results_mutex);
+}
 
+// Search the position with the root move scheduler until a limit is hit
+// Returns false if there are no legal moves
+bool search(Chess* chess, SearchLimits* limits, SearchResult* result) {
     TIME_TYPE start = TIME_NOW();
-    TIME_TYPE endtime = TIME_PLUS_OFFSET_MS(start, millis);
+    int max_depth = limits->depth > 0 && limits->depth < 62 ? limits->depth : 62;
+    int n_threads = limits->threads > 0 ? limits->threads : default_threads();
     Move moves[MAX_LEGAL_MOVES];
     int scores[MAX_LEGAL_MOVES];
     result_t results[MAX_LEGAL_MOVES][64] = {0};
+    RootLine lines[MAX_LEGAL_MOVES] = {0};
     size_t n_moves = Chess_legal_moves_scored(chess, moves, scores, false);
-    if (n_moves < 1) return 1;
-    task_init(results, n_moves);
-
-    for (int i = 0; i < n_moves; i++) {
-        Chess chess_cp = *chess;
-        Move* move = &moves[i];
-        Piece capture = Chess_make_move(&chess_cp, move);
-        task_t task = {.chess = chess_cp,
-                       .capture = capture,
-                       .depth = 1,
-                       .move = moves[i],
-                       .move_index = i,
-                       .result = &results[i][1]};
-        task_push(task);
+    if (n_moves < 1) return false;
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+    bool timed = !limits->ponder && (limits->millis > 0 || limits->time_left > 0);
+    // Nothing to think about, a depth 1 search still gives the score
+    if (n_moves == 1 && timed) max_depth = 1;
+    int multipv = limits->multipv < MAX_MULTIPV ? limits->multipv : MAX_MULTIPV;
+    task_init(chess, results, lines, n_moves, n_threads, max_depth, multipv);
+    memset(&search_stats[1], 0, n_threads * sizeof(SearchStats));
+    memset(&move_histories[1], 0, n_threads * sizeof(MoveHistory));
+    if (search_profiles) memset(&search_profiles[1], 0, n_threads * sizeof(SearchProfile));
+
+    // Buckets are LIFO, push backwards so that the best ordered moves are popped first
+    for (int i = n_moves - 1; i >= 0; i--) {
+        task_push((task_t){.move = moves[i], .move_index = i, .depth = 1});
     }
 
     // printf("Finished filling up the task queue\n");
     // task_show();
 
-    pthread_t* threads = calloc(cpu_count(), sizeof(pthread_t));
-    for (int i = 0; i < cpu_count(); i++) {
-        if (pthread_create(&threads[i], NULL, play_thread, &endtime) != 0) {
-            perror("pthread_create failed");
-            return 1;
-        }
-    }
-
-    // Wait for threads to finish
-    for (int i = 0; i < cpu_count(); i++) {
-        pthread_join(threads[i], NULL);
+    // A ponder search may be stopped before it gets here, its caller clears the flag
+    if (!limits->ponder) atomic_store(&search_stop, false);
+    if (limits->ponder) {
+        // The clock starts with search_ponder_hit
+    } else if (limits->time_left > 0) {
+        time_manager_start(limits, start);
+        timer_arm(TIME_PLUS_OFFSET_MS(start, time_manager.hard_ms));
+    } else if (limits->millis > 0) {
+        timer_arm(TIME_PLUS_OFFSET_MS(start, limits->millis));
+    }
+    if (search_stream.enabled) {
+        search_stream.depth = 0;
+        search_stream.workers_done = 0;
+        pool_start(n_threads, play_thread, NULL);
+        search_stream_print(chess, moves, n_threads, start);
+        pool_wait();
+    } else {
+        pool_run(n_threads, play_thread, NULL);
     }
-
-    free(threads);
-    task_destroy();
+    timer_disarm();
+    time_manager.active = false;
 
     // Display results
     // for (int i = 0; i < n_moves; i++) {
@@ -3169,62 +4963,183 @@ int play(char* fen, int millis, char* game_history) {
     // }
 
     // Select best move in results
-    bool has_next = true;
-    int depth = 0, best_score = -INF;
-    Move best_move;
-    for (depth = 1; depth < 63 && has_next; depth++) {
-        best_score = -INF;
-        for (int i = 0; i < n_moves; i++) {
-            result_t result = results[i][depth];
-            if (result.reached && result.score > best_score) {
-                best_score = result.score;
-                best_move = moves[i];
-                has_next = results[i][depth + 1].reached;
-            }
-        }
-    }
+    int best_index = 0;
+    result->depth = results_best_move(results, n_moves, &best_index, &result->score);
+    result->move = moves[best_index];
+    result->line = lines[best_index];
+    result->n_multipv = 0;
+    if (multipv > 1) {
+        result->n_multipv = results_rank_moves(results, lines, moves, n_moves, best_index,
+                                               result->multipv, multipv);
+        // The best move is ranked at the depth of the search, not at its deepest result
+        result->multipv[0].score = result->score;
+        result->multipv[0].depth = result->depth;
+    }
+    result->stats = SearchStats_total(1, n_threads + 1);
+    // Profiles are collected into the main thread slot over the whole command
+    for (int i = 1; search_profiles && i <= n_threads; i++) {
+        SearchProfile_add(&search_profiles[0], &search_profiles[i]);
+    }
+    result->nodes = result->stats.nodes;
+    result->time = TIME_DIFF_S(TIME_NOW(), start);
+    return true;
+}
 
-    TIME_TYPE end = TIME_NOW();
-    double cpu_time = TIME_DIFF_S(end, start);
-    best_score = chess->turn == TURN_WHITE ? best_score : -best_score;
-    depth--;
+// Print the JSON object of a search of 'chess', with a "ponder" member if it was one
+static void play_print(Chess* chess, SearchLimits* limits, SearchResult* result,
+                       const char* ponder) {
+    double cpu_time = result->time;
+    int depth = result->depth;
+    int best_score = chess->turn == TURN_WHITE ? result->score : -result->score;
+    Move best_move = result->move;
 
     puts("{");
-    printf("  \"millis\": %d,\n", millis);
+    if (ponder) printf("  \"ponder\": \"%s\",\n", ponder);
+    if (limits->time_left > 0) {
+        printf("  \"soft_ms\": %d,\n", time_manager.soft_ms);
+        printf("  \"hard_ms\": %d,\n", time_manager.hard_ms);
+    } else {
+        printf("  \"millis\": %d,\n", limits->millis);
+    }
     printf("  \"depth\": %d,\n", depth);
     printf("  \"time\": %.3lf,\n", cpu_time);
-#ifdef TRACK_BETA_CUTOFFS
-    size_t cutoff_nodes = atomic_load(&total_nodes);
-    size_t cutoffs = atomic_load(&beta_cutoffs);
-    size_t first_cutoffs = atomic_load(&first_move_cutoffs);
-    size_t cutoff_idx = atomic_load(&total_cutoff_index);
-    double cutoff_rate = cutoff_nodes > 0 ? (double)cutoffs * 100.0 / cutoff_nodes : 0;
-    double first_move_rate = cutoffs > 0 ? (double)first_cutoffs * 100.0 / cutoff_nodes : 0;
-    double avg_cutoff_index = cutoffs > 0 ? (double)cutoff_idx / cutoffs : 0;
-    printf("  \"cutoff_nodes\": %lu,\n", (unsigned long)cutoff_nodes);
-    printf("  \"beta_cutoff_%%\": %.2f,\n", cutoff_rate);
-    printf("  \"first_move_cutoff_%%\": %.2f,\n", first_move_rate);
-    printf("  \"avg_cutoff_index\": %.2f,\n", avg_cutoff_index);
-#endif
-#ifdef TRACK_TT
-    size_t lookups = atomic_load(&tt_lookups);
-    size_t hits = atomic_load(&tt_hits);
-    size_t collisions = atomic_load(&tt_collisions);
-    size_t stores = atomic_load(&tt_stores);
-    double hit_rate = lookups > 0 ? (double)hits * 100.0 / lookups : 0;
-    double collision_rate = stores > 0 ? (double)collisions * 100.0 / stores : 0;
-    printf("  \"tt_hit_rate_%%\": %.2f,\n", hit_rate);
-    printf("  \"tt_collision_rate_%%\": %.2f,\n", collision_rate);
-    printf("  \"TT_occupancy_%%\": %.2f,\n", TT_occupancy() * 100.0);
-#endif
-#ifdef TRACK_NODES
-    size_t nodes = atomic_load(&nodes_searched);
-    printf("  \"nodes\": %lu,\n", (unsigned long)nodes);
-    printf("  \"nps\": %.0lf,\n", cpu_time > 0.0 ? (double)nodes / cpu_time : 0.0);
-#endif
+    printf("  \"nodes\": %lu,\n", (unsigned long)result->nodes);
+    printf("  \"nps\": %.0lf,\n", cpu_time > 0.0 ? (double)result->nodes / cpu_time : 0.0);
+    if (stats_enabled) SearchStats_print(&result->stats, "  ");
+    if (profile) SearchProfile_print(profile, "  ");
+    if (result->n_multipv > 0) {
+        printf("  \"multipv\": [\n");
+        for (int i = 0; i < result->n_multipv; i++) {
+            RootMoveResult* rm = &result->multipv[i];
+            int score = chess->turn == TURN_WHITE ? rm->score : -rm->score;
+            printf("    {\"move\": \"%s\", \"eval\": %.2f, \"depth\": %d, \"pv\": [",
+                   Move_string(&rm->move), (double)score / 100, rm->depth);
+            for (int j = 0; j < rm->line.length; j++) {
+                printf(j > 0 ? ", \"%s\"" : "\"%s\"", Move_string(&rm->line.moves[j]));
+            }
+            printf(i + 1 < result->n_multipv ? "]},\n" : "]}\n");
+        }
+        printf("  ],\n");
+    }
     printf("  \"eval\": %.2f,\n", (double)best_score / 100);
+    printf("  \"pv\": [");
+    for (int i = 0; i < result->line.length; i++) {
+        printf(i > 0 ? ", \"%s\"" : "\"%s\"", Move_string(&result->line.moves[i]));
+    }
+    printf("],\n");
     printf("  \"move\": \"%s\"\n", Move_string(&best_move));
     puts("}");
+}
+
+// Play a move given a FEN string, with a fixed time (millis) or a clock (time_left)
+// Returns 0 on success, 1 on error
+int play(char* fen, SearchLimits* limits, char* game_history) {
+    Chess* chess = Chess_from_fen(fen);
+    if (!chess) return 1;
+    if (limits->millis < 1 && limits->time_left < 1) return 1;
+
+    if (game_history != NULL) {
+        Chess_game_history(chess, game_history);
+    }
+
+    if (chess->fullmoves <= 5 && openings_db(chess)) {
+        return 0;
+    }
+
+    SearchResult result;
+    if (!search(chess, limits, &result)) return 1;
+    play_print(chess, limits, &result, NULL);
+    return 0;
+}
+
+// The move to play from 'chess' written as in Move_string, false if it is not legal
+static bool Chess_legal_move_from_string(Chess* chess, const char* str, Move* move) {
+    Move moves[MAX_LEGAL_MOVES];
+    int scores[MAX_LEGAL_MOVES];
+    size_t n_moves = Chess_legal_moves_scored(chess, moves, scores, false);
+    for (int i = 0; i < n_moves; i++) {
+        if (strcmp(Move_string(&moves[i]), str) == 0) {
+            *move = moves[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+class {
+    Chess* chess;
+    SearchLimits limits;
+    SearchResult result;
+    bool found;
+}
+PonderJob;
+
+static void* ponder_thread(void* arg) {
+    PonderJob* job = arg;
+    job->found = search(job->chess, &job->limits, &job->result);
+    return NULL;
+}
+
+// Search the position after 'expected', the move the opponent is thought to play, on
+// the opponent's clock. The move actually played is then read from stdin:
+// - 'ponderhit' or the expected move: the search goes on, with the clock starting now
+// - another move: the search is aborted and the position after that move is searched
+//   with the transposition table it filled
+// - 'stop' or the end of the input: the search is aborted without a move
+// Returns 0 on success, 1 on error
+int ponder(char* fen, char* expected, SearchLimits* limits, char* game_history) {
+    char* fen_copy = strdup(fen);
+    Chess* chess = Chess_from_fen(fen_copy);
+    free(fen_copy);
+    if (!chess) return 1;
+    if (limits->time_left < 1) return 1;
+    if (game_history != NULL) Chess_game_history(chess, game_history);
+
+    Move move;
+    if (!Chess_legal_move_from_string(chess, expected, &move)) return 1;
+    PonderJob job = {.chess = malloc(sizeof(Chess)), .limits = *limits};
+    memcpy(job.chess, chess, sizeof(Chess));
+    Chess_make_move(job.chess, &move);
+    job.limits.ponder = true;
+
+    pthread_t thread;
+    atomic_store(&search_stop, false);
+    if (pthread_create(&thread, NULL, ponder_thread, &job) != 0) {
+        perror("pthread_create failed");
+        return 1;
+    }
+
+    char line[64] = "";
+    if (!fgets(line, sizeof(line), stdin)) line[0] = 0;
+    line[strcspn(line, "\r\n")] = 0;
+
+    bool hit = strcmp(line, "ponderhit") == 0 || strcmp(line, expected) == 0;
+    if (hit) {
+        search_ponder_hit(limits);
+    } else {
+        search_request_stop();
+    }
+    pthread_join(thread, NULL);
+    // The hit may come after the search ended on its own, nothing must fire later
+    timer_disarm();
+    time_manager.active = false;
+
+    if (hit) {
+        if (!job.found) return 1;
+        play_print(job.chess, limits, &job.result, "hit");
+        return 0;
+    }
+    if (line[0] == 0 || strcmp(line, "stop") == 0) {
+        puts("{\n  \"ponder\": \"stopped\"\n}");
+        return 0;
+    }
+
+    // Missed, search the position that is on the board
+    if (!Chess_legal_move_from_string(chess, line, &move)) return 1;
+    Chess_make_move(chess, &move);
+    SearchResult result;
+    if (!search(chess, limits, &result)) return 1;
+    play_print(chess, limits, &result, "miss");
     return 0;
 }
 
@@ -3235,7 +5150,7 @@ int version() {
 
 void help(void) {
     printf("SigmaZero Chess Engine - Command Line Interface\n\n");
-    printf("Usage: sigma-zero <command> [arguments]\n\n");
+    printf("Usage: sigma-zero [options] <command> [arguments]\n\n");
     printf("Commands:\n");
 #define HELP_WIDTH "  %-30s"
     printf(HELP_WIDTH " %s\n", "help, -h, --help", "Show this help message");
@@ -3245,15 +5160,52 @@ void help(void) {
     printf(HELP_WIDTH " %s\n", "", "  FEN: Position in FEN notation");
     printf(HELP_WIDTH " %s\n", "", "  millis: Time limit in milliseconds");
     printf(HELP_WIDTH " %s\n", "", "  history: Optional game history");
+    printf(HELP_WIDTH " %s\n", "go <FEN> <time> <inc> <movestogo> [history]",
+           "Play with a clock, stops early on a stable best move");
+    printf(HELP_WIDTH " %s\n", "", "  time, inc: Time left and increment in milliseconds");
+    printf(HELP_WIDTH " %s\n", "", "  movestogo: Moves to the next time control, 0 if none");
+    printf(HELP_WIDTH " %s\n", "ponder <FEN> <move> <time> <inc> <movestogo> [history]",
+           "Think on the opponent's time about the reply to <move>");
+    printf(HELP_WIDTH " %s\n", "", "  Then reads the move played on stdin: 'ponderhit' or");
+    printf(HELP_WIDTH " %s\n", "", "  <move> goes on with the clock, another move searches");
+    printf(HELP_WIDTH " %s\n", "", "  the real position, 'stop' gives up");
     printf("\n");
-    printf(HELP_WIDTH " %s\n", "moves <FEN> <depth>", "Count legal moves at depth");
+    printf(HELP_WIDTH " %s\n", "moves <FEN> <depth> [divide]", "Count legal moves at depth");
     printf(HELP_WIDTH " %s\n", "", "  depth: Search depth (perft)");
+    printf(HELP_WIDTH " %s\n", "", "  divide: Also show the count of every root move");
+    printf(HELP_WIDTH " %s\n", "perft-suite <file> [max_depth]",
+           "Check perft counts of an EPD file");
+    printf(HELP_WIDTH " %s\n", "", "  file: Lines of <FEN> ;D<depth> <nodes> ...");
+    printf(HELP_WIDTH " %s\n", "", "  max_depth: Skip deeper counts");
+    printf("\n");
+    printf(HELP_WIDTH " %s\n", "bench [depth] [threads] [hash]", "Search the bench positions");
+    printf(HELP_WIDTH " %s\n", "", "  depth: Fixed search depth (default 7)");
+    printf(HELP_WIDTH " %s\n", "", "  threads: Worker threads (default 1, deterministic)");
+    printf(HELP_WIDTH " %s\n", "", "  hash: Transposition table size in MB (default 64)");
+    printf(HELP_WIDTH " %s\n", "scaling-bench [depth] [threads] [hash]",
+           "Bench with 1, 2, 4, ... threads");
+    printf(HELP_WIDTH " %s\n", "", "  threads: Most threads to try (default all cores)");
+    printf(HELP_WIDTH " %s\n", "", "  Table on stderr, JSON on stdout");
     printf("\n");
     printf(HELP_WIDTH " %s\n", "eval <FEN>", "Evaluate position");
     printf(HELP_WIDTH " %s\n", "hash <FEN>", "Show zobrist hash");
     printf(HELP_WIDTH " %s\n", "scores <FEN>", "Show move scores");
     printf(HELP_WIDTH " %s\n", "kingsafety <FEN>", "Show king danger scores");
     printf("\n");
+    printf("Options:\n");
+    printf(HELP_WIDTH " %s\n", "--stats", "Add search statistics to play, bench and minmax");
+    printf(HELP_WIDTH " %s\n", "--threads <n>",
+           "Worker threads of play and moves (default all cores)");
+    printf(HELP_WIDTH " %s\n", "--affinity <cpus>", "Pin workers to a cpu list like 0-3,8");
+    printf(HELP_WIDTH " %s\n", "--split", "Let idle workers help inside the tree (YBWC)");
+    printf(HELP_WIDTH " %s\n", "--multipv <k>",
+           "Report the best k root moves of play, go and ponder");
+    printf(HELP_WIDTH " %s\n", "--stream",
+           "Print a JSON line per depth of play, go and ponder first");
+    printf(HELP_WIDTH " %s\n", "--trace <file>", "Write a Chrome trace of the search threads");
+    printf(HELP_WIDTH " %s\n", "--profile",
+           "Add per depth and per ply search profile to play, bench and eval");
+    printf("\n");
     printf("Examples:\n");
     printf("  sigma-zero play \"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1\" 1000\n");
     printf("  sigma-zero moves \"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1\" 5\n");
@@ -3265,23 +5217,22 @@ int eval_command(Chess* chess, int depth) {
         printf("%lg", (double)eval(chess) / 100.0);
     } else {
         int score = 0;
+        profile_root_sp = chess->zhstack.sp;
 
         for (int d = 0; d <= depth; d++) {
-#ifdef TRACK_NODES
-            size_t base_nodes = atomic_load(&nodes_searched);
-#endif
+            uint64_t base_nodes = stats->nodes;
 
             TIME_TYPE start = TIME_NOW();
             int window_alpha = ASP_WINDOW_ALPHA_INIT, window_beta = ASP_WINDOW_BETA_INIT;
 
             if (d == 0) {
-                score = -minimax(chess, UINT64_MAX, d, -INF, INF, EMPTY, 0);
+                score = -minimax(chess, search_stack_root(), d, -INF, INF, EMPTY, 0);
             } else {
                 int prev_score = score;
                 while (1) {
                     int alpha = prev_score - window_alpha;
                     int beta = prev_score + window_beta;
-                    score = -minimax(chess, UINT64_MAX, d, -beta, -alpha, EMPTY, 0);
+                    score = -minimax(chess, search_stack_root(), d, -beta, -alpha, EMPTY, 0);
                     if (score <= alpha) {
                         if (window_alpha > 100) {
                             window_alpha = INF;
@@ -3303,20 +5254,19 @@ int eval_command(Chess* chess, int depth) {
             double cpu_time = TIME_DIFF_S(end, start);
             double e = (double)score / 100.0;
 
-#ifdef TRACK_NODES
-            size_t nodes = atomic_load(&nodes_searched) - base_nodes;
-            printf("Depth %d: %lg reached in %.3lg seconds with %zu nodes\n", d, e, cpu_time,
-                   nodes);
-#else
-            printf("Depth %d: %lg reached in %.3lg seconds\n", d, e, cpu_time);
-#endif
+            uint64_t nodes = stats->nodes - base_nodes;
+            printf("Depth %d: %lg reached in %.3lg seconds with %" PRIu64 " nodes\n", d, e,
+                   cpu_time, nodes);
+        }
+        printf("%" PRIu64 " total nodes\n", stats->nodes);
+        if (profile) {
+            puts("{");
+            SearchProfile_print(profile, "  ");
+            printf("  \"nodes\": %" PRIu64 "\n", stats->nodes);
+            puts("}");
         }
     }
 
-#ifdef TRACK_NODES
-    size_t nodes = atomic_load(&nodes_searched);
-    printf("%zu total nodes\n", nodes);
-#endif
     return 0;
 }
 
@@ -3350,25 +5300,173 @@ int minmax_command(int depth) {
     TIME_TYPE start = TIME_NOW();
 
     while (fgets(fen, 1024, f)) {
-        memset(tt, 0, sizeof(tt));
+        TT_clear();
         fen[strcspn(fen, "\r\n")] = 0;
         Chess* chess = Chess_from_fen(fen);
         if (chess == NULL) continue;
-        minimax(chess, UINT64_MAX, depth, -INF, INF, EMPTY, 0);
+        minimax(chess, search_stack_root(), depth, -INF, INF, EMPTY, 0);
     }
 
     TIME_TYPE end = TIME_NOW();
     double cpu_time = TIME_DIFF_S(end, start);
     printf("{\n");
     printf("    \"time\" : %.3lf,\n", cpu_time);
-#ifdef TRACK_NODES
-    size_t nodes = atomic_load(&nodes_searched);
-    printf("    \"nodes\": %zu\n", nodes);
-#endif
+    if (stats_enabled) SearchStats_print(stats, "    ");
+    printf("    \"nodes\": %" PRIu64 "\n", stats->nodes);
     printf("}\n");
     return 0;
 }
 
+// Fixed positions of the bench command (openings, middlegames and endgames)
+static const char* BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r1bq1rk1/ppp2pp1/1bnp1n1p/4p3/2BPP3/P1P2N1P/1P3PP1/RNBQR1K1 b - - 0 9",
+    "1rbq1rk1/1ppnbppp/p3pn2/3p4/2PP1B2/1PN2NP1/P3PPBP/R2Q1RK1 b - - 2 9",
+    "r2q1rk1/ppp2ppp/1b1p1n2/n3p3/4P1b1/1BPP1N2/PP1N1PPP/R1BQR1K1 w - - 7 10",
+    "r1bqkb1r/pp1n1p1p/3p1np1/2pPp1B1/2P1P3/2N5/PP2BPPP/R2QK1NR b KQkq - 3 7",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r1bq1rk1/p5pp/1p3b2/2pp4/1n1Pp3/1P2P1P1/1B1Q1PBP/2R1NRK1 b - - 1 17",
+    "2kr1n2/5p2/pq4p1/1p2Pp2/8/5NR1/PPP1QPP1/1K6 w - - 0 23",
+    "4r1k1/p1qb1pp1/1p3n1p/2pp4/3P1N2/2PQ1P2/PP2R1PP/1B4K1 b - - 2 21",
+    "6k1/5pp1/PbN1p2p/2rn1b2/Q7/6P1/5PKP/5B2 b - - 10 39",
+    "8/R7/p1k1p3/1p3p2/8/P7/KPP2PP1/3r4 b - - 4 31",
+    "8/6k1/5q1p/1p6/8/7P/6P1/Q6K w - - 11 62",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/8/4k3/3p4/3P4/4K3/8/8 w - - 0 60",
+};
+
+#define BENCH_DEFAULT_DEPTH 7
+
+// Search every bench position to a fixed depth with a cleared TT
+// With one thread the total node count is a signature of the search: it only
+// changes when the search itself changes
+int bench_command(int depth, int threads, int hash_mb) {
+    if (depth < 1 || threads < 1 || hash_mb < 1) return 1;
+    if (!TT_resize(hash_mb)) {
+        fprintf(stderr, "Could not allocate a %dMB transposition table\n", hash_mb);
+        return 1;
+    }
+
+    int n_positions = sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]);
+    uint64_t total_nodes = 0;
+    double total_time = 0.0;
+    int total_hashfull = 0;
+    SearchStats total_stats = {0};
+
+    puts("{");
+    printf("  \"depth\": %d,\n", depth);
+    printf("  \"threads\": %d,\n", threads);
+    printf("  \"hash\": %d,\n", hash_mb);
+    puts("  \"positions\": [");
+
+    for (int i = 0; i < n_positions; i++) {
+        char fen[256];
+        snprintf(fen, sizeof(fen), "%s", BENCH_FENS[i]);
+        Chess* chess = Chess_from_fen(fen);
+        if (!chess) return 1;
+
+        // Clear outside of the timed search
+        TT_clear();
+
+        SearchLimits limits = {.millis = 0, .depth = depth, .threads = threads};
+        SearchResult result;
+        if (!search(chess, &limits, &result)) return 1;
+        int hashfull = TT_hashfull();
+        free(chess);
+
+        total_nodes += result.nodes;
+        total_time += result.time;
+        total_hashfull += hashfull;
+        SearchStats_add(&total_stats, &result.stats);
+        printf("    {\"fen\": \"%s\", \"move\": \"%s\", \"depth\": %d, \"nodes\": %" PRIu64
+               ", \"time\": %.3lf, \"hashfull\": %d}%s\n",
+               BENCH_FENS[i], Move_string(&result.move), result.depth, result.nodes,
+               result.time, hashfull, i + 1 < n_positions ? "," : "");
+    }
+
+    puts("  ],");
+    printf("  \"nodes\": %" PRIu64 ",\n", total_nodes);
+    printf("  \"time\": %.3lf,\n", total_time);
+    printf("  \"nps\": %.0lf,\n", total_time > 0.0 ? (double)total_nodes / total_time : 0.0);
+    printf("  \"time_to_depth\": %.3lf,\n", total_time / n_positions);
+    printf("  \"late_move_prunes\": %" PRIu64 ",\n", total_stats.late_move_prunes);
+    printf("  \"history_prunes\": %" PRIu64 ",\n", total_stats.history_prunes);
+    if (stats_enabled) SearchStats_print(&total_stats, "  ");
+    if (profile) SearchProfile_print(profile, "  ");
+    printf("  \"hashfull\": %d\n", total_hashfull / n_positions);
+    puts("}");
+    return 0;
+}
+
+// Search the bench positions with 1, 2, 4, ... max_threads threads (max_threads included)
+// Prints a table on stderr and the JSON results on stdout
+int scaling_bench_command(int depth, int max_threads, int hash_mb) {
+    if (depth < 1 || max_threads < 1 || hash_mb < 1) return 1;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    if (!TT_resize(hash_mb)) {
+        fprintf(stderr, "Could not allocate a %dMB transposition table\n", hash_mb);
+        return 1;
+    }
+
+    int n_positions = sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]);
+    Move base_moves[sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0])];
+    double base_time = 0.0;
+
+    fprintf(stderr, "%8s %12s %10s %10s %8s %10s %9s\n", "threads", "nodes", "nps", "time",
+            "speedup", "efficiency", "agreement");
+    puts("{");
+    printf("  \"depth\": %d,\n", depth);
+    printf("  \"hash\": %d,\n", hash_mb);
+    puts("  \"runs\": [");
+
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        uint64_t nodes = 0;
+        double time = 0.0;
+        int agreements = 0;
+
+        for (int i = 0; i < n_positions; i++) {
+            char fen[256];
+            snprintf(fen, sizeof(fen), "%s", BENCH_FENS[i]);
+            Chess* chess = Chess_from_fen(fen);
+            if (!chess) return 1;
+            TT_clear();
+
+            SearchLimits limits = {.millis = 0, .depth = depth, .threads = threads};
+            SearchResult result;
+            if (!search(chess, &limits, &result)) return 1;
+            free(chess);
+
+            nodes += result.nodes;
+            time += result.time;
+            if (threads == 1) base_moves[i] = result.move;
+            agreements += result.move.from == base_moves[i].from &&
+                          result.move.to == base_moves[i].to &&
+                          result.move.promotion == base_moves[i].promotion;
+        }
+
+        if (threads == 1) base_time = time;
+        double nps = time > 0.0 ? (double)nodes / time : 0.0;
+        double speedup = time > 0.0 ? base_time / time : 0.0;
+        double efficiency = speedup / threads;
+        double agreement = (double)agreements * 100.0 / n_positions;
+        bool last = threads >= max_threads;
+
+        fprintf(stderr, "%8d %12" PRIu64 " %10.0lf %10.3lf %8.2lf %9.1lf%% %8.1lf%%\n", threads,
+                nodes, nps, time, speedup, efficiency * 100.0, agreement);
+        printf("    {\"threads\": %d, \"nodes\": %" PRIu64 ", \"nps\": %.0lf, "
+               "\"time_to_depth\": %.3lf, \"speedup\": %.3lf, \"efficiency\": %.3lf, "
+               "\"best_move_agreement_%%\": %.1lf}%s\n",
+               threads, nodes, nps, time / n_positions, speedup, efficiency, agreement,
+               last ? "" : ",");
+        if (last) break;
+    }
+
+    puts("  ]");
+    puts("}");
+    return 0;
+}
+
 int compute_eval_loss() {
     FILE* f = fopen("data/chessData.csv", "r");
     if (f == NULL) {
@@ -3392,7 +5490,7 @@ int compute_eval_loss() {
         Chess* chess = Chess_from_fen(fen);
         if (chess == NULL) continue;  // failed to parse FEN
         // int sigmazero_eval = eval(chess);
-        int sigmazero_eval = minimax(chess, UINT64_MAX, 3, -INF, INF, EMPTY, 0);
+        int sigmazero_eval = minimax(chess, search_stack_root(), 3, -INF, INF, EMPTY, 0);
 
         // clamp error
         int diff = sigmazero_eval - stockfish_eval;
@@ -3426,7 +5524,58 @@ int test() {
     return 0;
 }
 
+// Harnesses that include this file (e.g. microbench.c) bring their own main()
+#ifndef SIGMA_ZERO_NO_MAIN
+// Remove the global options from argv, they can be anywhere on the command line
+int parse_options(int argc, char** argv) {
+    int n = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats_enabled = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            search_threads = atoi(argv[++i]);
+            if (search_threads < 1 || search_threads > MAX_THREADS) {
+                fprintf(stderr, "--threads must be between 1 and %d\n", MAX_THREADS);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--affinity") == 0 && i + 1 < argc) {
+            if (!affinity_parse(argv[++i])) {
+                fprintf(stderr, "Invalid cpu list for --affinity: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_init(argv[++i]);
+            atexit(trace_dump);
+        } else if (strcmp(argv[i], "--multipv") == 0 && i + 1 < argc) {
+            multipv_lines = atoi(argv[++i]);
+            if (multipv_lines < 1 || multipv_lines > MAX_MULTIPV) {
+                fprintf(stderr, "--multipv must be between 1 and %d\n", MAX_MULTIPV);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            search_stream.enabled = true;
+        } else if (strcmp(argv[i], "--split") == 0) {
+            split_enabled = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            if (!search_profiles) search_profiles = calloc(MAX_THREADS + 1, sizeof(SearchProfile));
+            profile = search_profiles;
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+    argv[n] = NULL;
+    return n;
+}
+
 int main(int argc, char** argv) {
+    argc = parse_options(argc, argv);
+    if (!TT_resize(TT_DEFAULT_MB)) {
+        fprintf(stderr, "Could not allocate the transposition table\n");
+        return 1;
+    }
+    reductions_init();
+    cuckoo_init();
+
     if (argc < 2 || strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 ||
         strcmp(argv[1], "-h") == 0) {
         help();
@@ -3437,15 +5586,34 @@ int main(int argc, char** argv) {
     } else if (strcmp(argv[1], "test") == 0) {
         return test();
     } else if ((argc == 4 || argc == 5) && strcmp(argv[1], "play") == 0) {
-        int millis = atoi(argv[3]);
-        if (argc == 4) {
-            return play(argv[2], millis, NULL);
-        } else {
-            return play(argv[2], millis, argv[4]);
-        }
-    } else if (argc == 4 && strcmp(argv[1], "moves") == 0) {
+        SearchLimits limits = {.millis = atoi(argv[3]),
+                               .threads = default_threads(),
+                               .multipv = multipv_lines};
+        return play(argv[2], &limits, argc == 5 ? argv[4] : NULL);
+    } else if ((argc == 6 || argc == 7) && strcmp(argv[1], "go") == 0) {
+        SearchLimits limits = {.time_left = atoi(argv[3]),
+                               .increment = atoi(argv[4]),
+                               .movestogo = atoi(argv[5]),
+                               .threads = default_threads(),
+                               .multipv = multipv_lines};
+        return play(argv[2], &limits, argc == 7 ? argv[6] : NULL);
+    } else if ((argc == 7 || argc == 8) && strcmp(argv[1], "ponder") == 0) {
+        SearchLimits limits = {.time_left = atoi(argv[4]),
+                               .increment = atoi(argv[5]),
+                               .movestogo = atoi(argv[6]),
+                               .threads = default_threads(),
+                               .multipv = multipv_lines};
+        return ponder(argv[2], argv[3], &limits, argc == 8 ? argv[7] : NULL);
+    } else if ((argc == 4 || argc == 5) && strcmp(argv[1], "moves") == 0) {
         int depth = atoi(argv[3]);
-        return moves(argv[2], depth);
+        if (argc == 5 && strcmp(argv[4], "divide") != 0) {
+            help();
+            return 1;
+        }
+        return moves(argv[2], depth, argc == 5);
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "perft-suite") == 0) {
+        int max_depth = argc == 4 ? atoi(argv[3]) : 0;
+        return perft_suite(argv[2], max_depth);
     } else if (argc == 4 && strcmp(argv[1], "eval") == 0) {
         Chess* chess = Chess_from_fen(argv[2]);
         int depth = atoi(argv[3]);
@@ -3467,6 +5635,16 @@ int main(int argc, char** argv) {
     } else if (argc == 3 && strcmp(argv[1], "minmax") == 0) {
         int depth = atoi(argv[2]);
         return minmax_command(depth);
+    } else if (argc <= 5 && strcmp(argv[1], "bench") == 0) {
+        int depth = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_DEPTH;
+        int threads = argc > 3 ? atoi(argv[3]) : 1;
+        int hash_mb = argc > 4 ? atoi(argv[4]) : TT_DEFAULT_MB;
+        return bench_command(depth, threads, hash_mb);
+    } else if (argc <= 5 && strcmp(argv[1], "scaling-bench") == 0) {
+        int depth = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_DEPTH;
+        int max_threads = argc > 3 ? atoi(argv[3]) : default_threads();
+        int hash_mb = argc > 4 ? atoi(argv[4]) : TT_DEFAULT_MB;
+        return scaling_bench_command(depth, max_threads, hash_mb);
     } else if (strcmp(argv[1], "eval_loss") == 0) {
         return compute_eval_loss();
     } else {
@@ -3474,3 +5652,4 @@ int main(int argc, char** argv) {
         return 1;
     }
 }
+#endif
@@ -0,0 +1,279 @@
+// Microbenchmarks of the engine's hot primitives
+// Usage: sigma-zero-microbench [corpus] [repetitions]
+// Every primitive runs over all the positions of the corpus once per repetition.
+// The JSON report gives the median and p99 over the repetitions of ns/op and
+// cycles/op (CPU cycles from perf_event_open, else TSC ticks, else none).
+#define SIGMA_ZERO_NO_MAIN
+#include "main.c"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MICROBENCH_MAX_POSITIONS 1024
+#define MICROBENCH_WARMUP 5
+#define MICROBENCH_DEFAULT_REPETITIONS 100
+
+class {
+    Chess chess;
+    Move moves[MAX_LEGAL_MOVES];
+    size_t n_moves;
+}
+BenchPosition;
+
+BenchPosition* corpus_positions;
+int n_positions = 0;
+uint64_t* tt_keys;  // Hashes of every child position of the corpus
+size_t n_tt_keys = 0;
+
+// Keeps the compiler from dropping the benchmarked calls
+volatile int64_t sink;
+
+// Cycle counter
+typedef enum { CYCLES_NONE, CYCLES_PERF, CYCLES_RDTSC } CyclesSource;
+CyclesSource cycles_source = CYCLES_NONE;
+int perf_fd = -1;
+
+void cycles_init(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd >= 0) {
+        cycles_source = CYCLES_PERF;
+        return;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    cycles_source = CYCLES_RDTSC;
+#endif
+}
+
+static inline uint64_t cycles_now(void) {
+    switch (cycles_source) {
+#ifdef __linux__
+        case CYCLES_PERF: {
+            uint64_t count = 0;
+            if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) return 0;
+            return count;
+        }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        case CYCLES_RDTSC:
+            return __rdtsc();
+#endif
+        default:
+            return 0;
+    }
+}
+
+static inline uint64_t precise_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Primitives: each runs once over the corpus and returns the number of operations
+
+uint64_t bench_make_unmake(void) {
+    uint64_t ops = 0;
+    for (int p = 0; p < n_positions; p++) {
+        Chess* chess = &corpus_positions[p].chess;
+        for (int i = 0; i < corpus_positions[p].n_moves; i++) {
+            Move* move = &corpus_positions[p].moves[i];
+            gamestate_t gamestate = chess->gamestate;
+            uint64_t hash = chess->zhash;
+            int e = chess->eval;
+            int pawn_row_sum = chess->pawn_row_sum;
+            bitboard_t bb_white = chess->bb_white;
+            bitboard_t bb_black = chess->bb_black;
+            Piece capture = Chess_make_move(chess, move);
+            sink += chess->zhash;
+            Chess_unmake_move(chess, move, capture);
+            chess->gamestate = gamestate;
+            chess->zhash = hash;
+            chess->eval = e;
+            chess->pawn_row_sum = pawn_row_sum;
+            chess->bb_white = bb_white;
+            chess->bb_black = bb_black;
+            ops++;
+        }
+    }
+    return ops;
+}
+
+uint64_t bench_legal_moves(void) {
+    Move moves[MAX_LEGAL_MOVES];
+    for (int p = 0; p < n_positions; p++) {
+        sink += Chess_legal_moves(&corpus_positions[p].chess, moves, false);
+    }
+    return n_positions;
+}
+
+uint64_t bench_legal_captures(void) {
+    Move moves[MAX_LEGAL_MOVES];
+    for (int p = 0; p < n_positions; p++) {
+        sink += Chess_legal_moves(&corpus_positions[p].chess, moves, true);
+    }
+    return n_positions;
+}
+
+uint64_t bench_fill_attack_map(void) {
+    for (int p = 0; p < n_positions; p++) {
+        Chess_fill_attack_map(&corpus_positions[p].chess);
+        sink += corpus_positions[p].chess.enemy_attack_map.n_checks;
+    }
+    return n_positions;
+}
+
+uint64_t bench_eval(void) {
+    for (int p = 0; p < n_positions; p++) {
+        sink += eval(&corpus_positions[p].chess);
+    }
+    return n_positions;
+}
+
+uint64_t bench_king_safety(void) {
+    for (int p = 0; p < n_positions; p++) {
+        sink += Chess_king_safety(&corpus_positions[p].chess);
+    }
+    return n_positions;
+}
+
+uint64_t bench_tt_store(void) {
+    for (size_t i = 0; i < n_tt_keys; i++) {
+        sink += TT_store(tt_keys[i], (int)i, 1 + (i & 15), TT_EXACT, 0, 0);
+    }
+    return n_tt_keys;
+}
+
+uint64_t bench_tt_get(void) {
+    int e;
+    for (size_t i = 0; i < n_tt_keys; i++) {
+        sink += TT_get(tt_keys[i], &e, 1, -INF, INF);
+    }
+    return n_tt_keys;
+}
+
+class {
+    const char* name;
+    uint64_t (*fn)(void);
+}
+Primitive;
+
+static const Primitive PRIMITIVES[] = {
+    {"make_unmake_move", bench_make_unmake},
+    {"legal_moves", bench_legal_moves},
+    {"legal_moves_captures_only", bench_legal_captures},
+    {"fill_attack_map", bench_fill_attack_map},
+    {"eval", bench_eval},
+    {"king_safety", bench_king_safety},
+    {"tt_store", bench_tt_store},
+    {"tt_get", bench_tt_get},
+};
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Value at 'percentile' (0-100) of a sorted array
+double percentile_of(double* sorted, int n, double percentile) {
+    int i = (int)(percentile / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+bool load_corpus(char* filename) {
+    FILE* f = fopen(filename, "rt");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open file: %s\n", filename);
+        return false;
+    }
+
+    corpus_positions = malloc(MICROBENCH_MAX_POSITIONS * sizeof(BenchPosition));
+    tt_keys = malloc(MICROBENCH_MAX_POSITIONS * MAX_LEGAL_MOVES * sizeof(uint64_t));
+    char fen[1024];
+    while (n_positions < MICROBENCH_MAX_POSITIONS && fgets(fen, sizeof(fen), f)) {
+        fen[strcspn(fen, "\r\n")] = 0;
+        Chess* chess = Chess_from_fen(fen);
+        if (chess == NULL) continue;
+
+        BenchPosition* position = &corpus_positions[n_positions++];
+        position->chess = *chess;
+        free(chess);
+        position->n_moves = Chess_legal_moves(&position->chess, position->moves, false);
+
+        for (int i = 0; i < position->n_moves; i++) {
+            Chess child = position->chess;
+            Chess_make_move(&child, &position->moves[i]);
+            tt_keys[n_tt_keys++] = child.zhash;
+        }
+    }
+
+    fclose(f);
+    return n_positions > 0;
+}
+
+int main(int argc, char** argv) {
+    char* corpus = argc > 1 ? argv[1] : "data/training.txt";
+    int repetitions = argc > 2 ? atoi(argv[2]) : MICROBENCH_DEFAULT_REPETITIONS;
+    if (repetitions < 1) return 1;
+
+    if (!TT_resize(TT_DEFAULT_MB)) return 1;
+    if (!load_corpus(corpus)) return 1;
+    cycles_init();
+
+    static const char* CYCLES_NAMES[] = {"none", "perf_event", "rdtsc"};
+    int n_primitives = sizeof(PRIMITIVES) / sizeof(PRIMITIVES[0]);
+    double* ns = malloc(repetitions * sizeof(double));
+    double* cycles = malloc(repetitions * sizeof(double));
+
+    puts("{");
+    printf("  \"corpus\": \"%s\",\n", corpus);
+    printf("  \"positions\": %d,\n", n_positions);
+    printf("  \"warmup\": %d,\n", MICROBENCH_WARMUP);
+    printf("  \"repetitions\": %d,\n", repetitions);
+    printf("  \"cycles\": \"%s\",\n", CYCLES_NAMES[cycles_source]);
+    puts("  \"results\": {");
+
+    for (int p = 0; p < n_primitives; p++) {
+        const Primitive* primitive = &PRIMITIVES[p];
+        uint64_t ops = 0;
+        for (int r = 0; r < MICROBENCH_WARMUP; r++) primitive->fn();
+
+        for (int r = 0; r < repetitions; r++) {
+            uint64_t start_cycles = cycles_now();
+            uint64_t start = precise_nanos();
+            ops = primitive->fn();
+            uint64_t end = precise_nanos();
+            uint64_t end_cycles = cycles_now();
+            ns[r] = (double)(end - start) / ops;
+            cycles[r] = (double)(end_cycles - start_cycles) / ops;
+        }
+
+        qsort(ns, repetitions, sizeof(double), compare_doubles);
+        qsort(cycles, repetitions, sizeof(double), compare_doubles);
+        printf("    \"%s\": {\"ops\": %" PRIu64
+               ", \"ns_per_op\": {\"median\": %.2lf, \"p99\": %.2lf}"
+               ", \"cycles_per_op\": {\"median\": %.2lf, \"p99\": %.2lf}}%s\n",
+               primitive->name, ops, percentile_of(ns, repetitions, 50),
+               percentile_of(ns, repetitions, 99), percentile_of(cycles, repetitions, 50),
+               percentile_of(cycles, repetitions, 99), p + 1 < n_primitives ? "," : "");
+    }
+
+    puts("  }");
+    puts("}");
+    free(ns);
+    free(cycles);
+    return 0;
+}
@@ -81,6 +81,15 @@ PRUNING_CONSTS = [
     "QUEEN_AGGRO_SCORE",
     "KING_AGGRO_SCORE",
     "TT_MOVE_BONUS",
+    "LMR_BASE",
+    "LMR_DIVISOR",
+    "LMR_HISTORY_DIVISOR",
+    "LMR_PV",
+    "LMR_NOT_IMPROVING",
+    "LMP_DEPTH",
+    "LMP_BASE",
+    "HP_DEPTH",
+    "HP_MARGIN",
 ]
 
 # FENs to use for tournament
@@ -440,8 +449,8 @@ def get_average_cutoff(value_name: str) -> float:
     
     for fen in CUTOFF_FENS:
         board = chess.Board(fen)
-        result = sigma_zero.play(board, TIME_CUTOFF)
-        cutoff_index = result[value_name]
+        result = sigma_zero.play(board, TIME_CUTOFF, stats=True)
+        cutoff_index = result[value_name] if value_name in result else result["stats"][value_name]
         # print(f"FEN: {fen} -> {value_name}: {cutoff_index}")
         total_cutoff_index += cutoff_index
     
@@ -450,7 +459,7 @@ def get_average_cutoff(value_name: str) -> float:
     return average_cutoff
 
 # Training loop for beta cutoff constants only
-# 1. Enable TRACK_BETA_CUTOFFS in main.c
+# 1. Run sigma-zero with --stats to get the beta cutoff statistics
 # 2. Make an average of beta cutoff index over set of fens in data/puzzles.txt
 # 3. Take the dict of constants 'best_consts' and select 1 in 5 for mutation (only those related to beta cutoffs)
 # 4. For each selected constant, randomly increase or decrease it by up to 10% (rounded to nearest non-zero integer)
@@ -460,11 +469,6 @@ def get_average_cutoff(value_name: str) -> float:
 # 8. If average beta cutoff index is improved, keep mutated constants as best_consts and go back to step 3
 def train_cutoff(value_name: str, maximize: bool):
     global best_consts, rand_noise
-    with open("src/main.c", "rt") as f:
-        main_c = f.read()
-    with open("src/main.c", "wt") as f:
-        f.write(main_c.replace("// #define TRACK_BETA_CUTOFFS", "#define TRACK_BETA_CUTOFFS"))
-    
     best_value = get_average_cutoff(value_name)
     log(f"=== Training {value_name} constants ===")
     log(f"Initial average {value_name}: {best_value:.2f}")
@@ -510,9 +514,6 @@ def train_cutoff(value_name: str, maximize: bool):
     
     log(f"Final average {value_name}: {best_value:.2f} after {n_mutations} successful mutations in {n_steps} steps.")
     
-    with open("src/main.c", "wt") as f:
-        f.write(main_c)
-    
     with open("src/consts.c", "w") as f:
         f.write(make_const_file(best_consts))
     print("Final best constants written to src/consts.c")
@@ -2,7 +2,7 @@ import os
 import subprocess
 import json
 import sys
-from typing import Any
+from typing import Any, Iterator
 from itertools import permutations
 
 import chess
@@ -68,6 +68,10 @@ def moves(fen: str, depth: int) -> dict:
     return dict(command(f'moves "{fen}" "{depth}"', JSON=True))
 
 
+def perft_suite(file: str = "data/perft.epd", max_depth: int = 0) -> dict:
+    return dict(command(f'perft-suite "{file}" "{max_depth}"', JSON=True))
+
+
 def get_history_stack(board: chess.Board) -> list[str]:
     history = []
     temp_board = board.copy()
@@ -79,13 +83,42 @@ def get_history_stack(board: chess.Board) -> list[str]:
     return history[::-1]
 
 
-def play(board: chess.Board, millis: int) -> dict:
+def play(board: chess.Board, millis: int, stats: bool = False) -> dict:
+    options = "--stats " if stats else ""
     history_str = ",".join(get_history_stack(board))
     if history_str:
-        result = dict(command(f'play "{board.fen()}" "{millis}" "{history_str}"', JSON=True))
+        result = dict(command(f'{options}play "{board.fen()}" "{millis}" "{history_str}"', JSON=True))
         if result.get("error") is None:
             return result
-    return dict(command(f'play "{board.fen()}" "{millis}"', JSON=True))
+    return dict(command(f'{options}play "{board.fen()}" "{millis}"', JSON=True))
+
+
+def go(board: chess.Board, time_left: int, increment: int = 0, movestogo: int = 0) -> dict:
+    clock = f'"{time_left}" "{increment}" "{movestogo}"'
+    history_str = ",".join(get_history_stack(board))
+    if history_str:
+        result = dict(command(f'go "{board.fen()}" {clock} "{history_str}"', JSON=True))
+        if result.get("error") is None:
+            return result
+    return dict(command(f'go "{board.fen()}" {clock}', JSON=True))
+
+
+def play_stream(board: chess.Board, millis: int) -> Iterator[dict]:
+    """Yield a progress dict per completed depth, then the final result of play"""
+    make()
+    history_str = ",".join(get_history_stack(board))
+    args = [EXE_FILE, "--stream", "play", board.fen(), str(millis)] + ([history_str] if history_str else [])
+    with subprocess.Popen(args, stdout=subprocess.PIPE, text=True) as process:
+        final = []
+        for line in process.stdout:
+            if final or line.strip() == "{":
+                final.append(line)
+            else:
+                yield json.loads(line)
+    try:
+        yield json.loads("".join(final))
+    except json.JSONDecodeError:
+        yield {"error": "Failed to parse JSON", "raw": "".join(final)}
 
 
 def fancy(board: chess.Board, millis: int) -> dict:
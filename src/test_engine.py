@@ -78,6 +78,43 @@ def test_move_generation(fen: str):
     assert mybot == chesslib
 
 
+def test_perft_suite():
+    result = sigma_zero.perft_suite()
+    assert result.get("failures") == []
+    assert result.get("failed") == 0
+
+
+def play_line(fen: str, moves: str, millis: int = 1000) -> dict:
+    """Play the engine after the UCI moves from fen, with the positions as game history."""
+    board = chess.Board(fen)
+    for move in moves.split():
+        board.push_uci(move)
+    return sigma_zero.play(board, millis)
+
+
+# White is lost, the knight shuffle has already reached the position after f3g1 twice
+# Nxd4 is searched first, unmaking it must give back the halfmove clock of the scan
+SHUFFLE = "g1f3 h8g8 f3g1 g8h8 g1f3 h8g8 f3g1 g8h8"
+
+
+def test_history_repetition():
+    result = play_line("7k/qr6/8/8/3p4/8/6PP/6NK w - - 0 30", SHUFFLE + " g1f3 h8g8")
+    assert result.get("move") == "f3g1"
+    assert result.get("eval") == 0.0
+
+
+def test_irreversible_move_blocks_repetition():
+    # The same shuffle with castling rights, then the king gives them up and comes back
+    result = play_line("7k/qr6/8/8/3p4/8/6PP/4K1NR w K - 0 30", SHUFFLE + " e1f1 h8g8 f1e1 g8h8 g1f3 h8g8")
+    assert result.get("eval") < -1.0
+
+
+def test_perpetual_check():
+    # Qg5+, Qf6+ and Qd8+ keep the king on the back rank
+    result = sigma_zero.play(chess.Board("6k1/5p1p/8/8/8/q7/r2Q1PPP/6K1 w - - 0 1"), 1000)
+    assert result.get("eval") == 0.0
+
+
 def find_wrong_move_generation(board: chess.Board, depth: int, search_depth: int = 1):
     sf_moves = count_moves(board, search_depth)
     n_moves = sigma_zero.moves(board.fen(), search_depth).get("nodes", -1)